@@ -1,4 +1,5 @@
 // 4/7/25, here we go again...
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,6 +10,25 @@
 #include <strings.h>
 #include <termios.h>
 #include <sys/ioctl.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <poll.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #define MAX_LINE 1024
 #define MAX_PACKAGES 10
@@ -17,6 +37,7 @@
 #define MAX_SCRIPT_LINES 100
 #define MAX_LINE_LENGTH 256
 #define MAX_OPTIONS 20
+#define SCRIPT_PLACEHOLDER "# Add your commands here"
 
 typedef struct {
     char name[256];
@@ -65,12 +86,19 @@ typedef struct {
 
 // Utility functions
 void trim(char *str) {
+    char *start = str;
     char *end;
-    while (isspace((unsigned char)*str)) str++;
-    if (*str == 0) return;
-    end = str + strlen(str) - 1;
-    while (end > str && isspace((unsigned char)*end)) end--;
+    while (isspace((unsigned char)*start)) start++;
+    if (*start == 0) {
+        *str = 0;
+        return;
+    }
+    end = start + strlen(start) - 1;
+    while (end > start && isspace((unsigned char)*end)) end--;
     end[1] = '\0';
+    if (start != str) {
+        memmove(str, start, end - start + 2);
+    }
 }
 
 void clear_screen() {
@@ -101,6 +129,144 @@ void print_disabled(const char *msg) {
     printf("\033[31m%s\033[0m", msg);
 }
 
+double monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+void json_write_string(FILE *fp, const char *str) {
+    fputc('"', fp);
+    for (const unsigned char *p = (const unsigned char *)str; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            fprintf(fp, "\\%c", *p);
+        } else if (*p < 0x20) {
+            fprintf(fp, "\\u%04x", *p);
+        } else {
+            fputc(*p, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+// Tracing
+//
+// TRACE_SCOPE(name) times the rest of the enclosing block and TRACE_COUNT
+// bumps a per-thread counter. Both only record anything after --trace has
+// switched tracing on; otherwise they cost one predictable branch. Building
+// with STARBUILD_NO_TRACE (CMake: -DSTARBUILD_TRACING=OFF) removes them.
+#ifndef STARBUILD_NO_TRACE
+typedef struct {
+    const char *name;
+    double start_us;
+    double dur_us;
+} TraceEvent;
+
+typedef struct TraceThread {
+    int tid;
+    TraceEvent *events;
+    int count;
+    int capacity;
+    uint64_t bytes_rendered;
+    uint64_t files_written;
+    uint64_t cache_hits;
+    struct TraceThread *next;
+} TraceThread;
+
+typedef struct {
+    const char *name;
+    double start_us;
+} TraceScope;
+
+static int trace_enabled;
+static const char *trace_file;
+static double trace_origin_us;
+static TraceThread *trace_threads;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread TraceThread *trace_self;
+
+TraceThread *trace_thread() {
+    if (!trace_self) {
+        trace_self = calloc(1, sizeof(TraceThread));
+        pthread_mutex_lock(&trace_lock);
+        trace_self->tid = trace_threads ? trace_threads->tid + 1 : 1;
+        trace_self->next = trace_threads;
+        trace_threads = trace_self;
+        pthread_mutex_unlock(&trace_lock);
+    }
+    return trace_self;
+}
+
+void trace_scope_end(TraceScope *scope) {
+    if (scope->start_us < 0) {
+        return;
+    }
+    TraceThread *thread = trace_thread();
+    if (thread->count == thread->capacity) {
+        thread->capacity = thread->capacity ? thread->capacity * 2 : 256;
+        thread->events = realloc(thread->events, thread->capacity * sizeof(TraceEvent));
+    }
+    TraceEvent *event = &thread->events[thread->count++];
+    event->name = scope->name;
+    event->start_us = scope->start_us;
+    event->dur_us = monotonic_us() - scope->start_us;
+}
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(label) \
+    TraceScope TRACE_CONCAT(trace_scope_, __LINE__) __attribute__((cleanup(trace_scope_end))) = \
+        { label, trace_enabled ? monotonic_us() : -1.0 }
+#define TRACE_COUNT(counter, amount) \
+    do { if (trace_enabled) trace_thread()->counter += (amount); } while (0)
+
+void trace_write() {
+    FILE *fp = fopen(trace_file, "w");
+    if (!fp) {
+        fprintf(stderr, "Could not write trace file %s\n", trace_file);
+        return;
+    }
+
+    int pid = (int)getpid();
+    double end = monotonic_us();
+    int first = 1;
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (TraceThread *thread = trace_threads; thread; thread = thread->next) {
+        for (int i = 0; i < thread->count; i++) {
+            TraceEvent *event = &thread->events[i];
+            fprintf(fp, "%s{\"name\":", first ? "" : ",\n");
+            json_write_string(fp, event->name);
+            fprintf(fp, ",\"cat\":\"starbuild\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                    pid, thread->tid, event->start_us - trace_origin_us, event->dur_us);
+            first = 0;
+        }
+        fprintf(fp, "%s{\"name\":\"counters\",\"ph\":\"C\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,"
+                    "\"args\":{\"bytes_rendered\":%llu,\"files_written\":%llu,\"cache_hits\":%llu}}",
+                first ? "" : ",\n", pid, thread->tid, end - trace_origin_us,
+                (unsigned long long)thread->bytes_rendered, (unsigned long long)thread->files_written,
+                (unsigned long long)thread->cache_hits);
+        first = 0;
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+}
+
+void trace_start(const char *filename) {
+    trace_file = filename;
+    trace_origin_us = monotonic_us();
+    trace_enabled = 1;
+    atexit(trace_write);
+}
+#else
+#define TRACE_SCOPE(label) do { } while (0)
+#define TRACE_COUNT(counter, amount) do { } while (0)
+
+void trace_start(const char *filename) {
+    (void)filename;
+    fprintf(stderr, "Tracing is not compiled into this build\n");
+}
+#endif
+
 // Terminal control functions
 void enable_raw_mode() {
     struct termios raw;
@@ -153,7 +319,7 @@ void get_multiline_input(const char *prompt, char script[][MAX_LINE_LENGTH], int
     
     // Ensure we have at least one line
     if (*line_count == 0) {
-        strcpy(script[0], "# Add your commands here");
+        strcpy(script[0], SCRIPT_PLACEHOLDER);
         *line_count = 1;
     }
 }
@@ -168,6 +334,33 @@ int get_yes_no(const char *prompt) {
     return 0;
 }
 
+// Like get_input, but keeps the current value (shown in brackets) on empty input
+void get_input_default(const char *prompt, char *buffer, size_t size) {
+    if (buffer[0] == '\0') {
+        get_input(prompt, buffer, size);
+        return;
+    }
+
+    char full_prompt[MAX_LINE];
+    char input[MAX_LINE] = "";
+    snprintf(full_prompt, sizeof(full_prompt), "%s [%s]", prompt, buffer);
+    get_input(full_prompt, input, sizeof(input));
+    if (strlen(input) > 0) {
+        snprintf(buffer, size, "%s", input);
+    }
+}
+
+// Scripts prefilled from a template or source archive are only re-entered on request
+void get_script_input(const char *prompt, char script[][MAX_LINE_LENGTH], int *line_count) {
+    if (*line_count > 0 && strcmp(script[0], SCRIPT_PLACEHOLDER) != 0) {
+        printf("%s\n(%d line(s) prefilled)\n", prompt, *line_count);
+        if (!get_yes_no("Replace it")) {
+            return;
+        }
+    }
+    get_multiline_input(prompt, script, line_count);
+}
+
 void suggest_package_name(char *suggested_name) {
     char cwd[256];
     if (getcwd(cwd, sizeof(cwd)) != NULL) {
@@ -186,719 +379,6260 @@ void suggest_package_name(char *suggested_name) {
     }
 }
 
-// Template functions
-void load_template(const char *template_name, StarbuildConfig *config) {
-    (void)config; // Suppress unused parameter warning
-    char filename[512];
-    snprintf(filename, sizeof(filename), "templates/%s.template", template_name);
-    
-    FILE *fp = fopen(filename, "r");
-    if (!fp) {
-        print_warning("Template not found, using defaults");
-        return;
+uint64_t fnv1a64(const void *data, size_t len, uint64_t hash) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
     }
-    
-    // Load template logic here (simplified for now)
-    fclose(fp);
-    print_success("Template loaded");
+    return hash;
 }
 
-void save_template(const char *template_name, StarbuildConfig *config) {
-    (void)config; // Suppress unused parameter warning
-    char filename[512];
-    snprintf(filename, sizeof(filename), "templates/%s.template", template_name);
-    
-    // Create templates directory if it doesn't exist
-    mkdir("templates", 0755);
-    
-    FILE *fp = fopen(filename, "w");
-    if (!fp) {
-        print_error("Could not save template");
-        return;
+uint64_t hash_string(const char *str) {
+    return fnv1a64(str, strlen(str), 0xcbf29ce484222325ULL);
+}
+
+// Growable string buffer
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} StrBuf;
+
+void sb_append(StrBuf *sb, const char *data, size_t len) {
+    if (sb->len + len + 1 > sb->cap) {
+        size_t cap = sb->cap ? sb->cap : 64;
+        while (cap < sb->len + len + 1) {
+            cap *= 2;
+        }
+        sb->data = realloc(sb->data, cap);
+        sb->cap = cap;
     }
-    
-    // Save template logic here
-    fclose(fp);
-    print_success("Template saved");
+    memcpy(sb->data + sb->len, data, len);
+    sb->len += len;
+    sb->data[sb->len] = '\0';
 }
 
-// Interactive wizard functions
-void wizard_advanced_fields(StarbuildConfig *config) {
-    print_header("Advanced Fields");
-    printf("Would you like to configure advanced package fields?\n");
-    printf("These include:\n");
-    printf("  - gives: Virtual packages this package provides\n");
-    printf("  - clashes: Packages that conflict with this one\n");
-    printf("  - optional_dependencies: Optional dependencies\n");
-    config->enable_advanced_fields = get_yes_no("Enable advanced fields");
+void sb_putc(StrBuf *sb, char c) {
+    sb_append(sb, &c, 1);
 }
 
-void wizard_basic_info(StarbuildConfig *config) {
-    print_header("Basic Package Information");
-    
-    char package_names[MAX_LINE];
-    char suggested_name[256];
-    suggest_package_name(suggested_name);
-    
-    char prompt[512];
-    snprintf(prompt, sizeof(prompt), "Package name(s) (comma-separated for multiple) [%s]", suggested_name);
-    get_input(prompt, package_names, sizeof(package_names));
-    
-    // If no input provided, use suggested name
-    if (strlen(package_names) == 0) {
-        strcpy(package_names, suggested_name);
+void sb_printf(StrBuf *sb, const char *fmt, ...) {
+    char buffer[MAX_LINE];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(buffer, sizeof(buffer), fmt, args);
+    va_end(args);
+    if (len > 0) {
+        sb_append(sb, buffer, len < (int)sizeof(buffer) ? (size_t)len : sizeof(buffer) - 1);
     }
-    
-    // Parse package names
-    char *token = strtok(package_names, ",");
-    config->package_count = 0;
-    while (token && config->package_count < MAX_PACKAGES) {
-        trim(token);
-        if (strlen(token) > 0) {
-            strcpy(config->packages[config->package_count].name, token);
-            config->package_count++;
-        }
-        token = strtok(NULL, ",");
+}
+
+char *read_file(const char *path, size_t *size) {
+    TRACE_SCOPE("read_file");
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        return NULL;
     }
-    
-    if (config->package_count == 0) {
-        print_error("No valid package names provided");
-        // Set a default package name
-        strcpy(config->packages[0].name, "mypackage");
-        config->package_count = 1;
-        print_warning("Using default package name 'mypackage'");
+    StrBuf sb = {0};
+    char buffer[65536];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+        sb_append(&sb, buffer, n);
     }
-    
-    // Get version and description
-    get_input("Package version", config->packages[0].version, sizeof(config->packages[0].version));
-    
-    // For multiple packages, get individual descriptions
-    if (config->package_count == 1) {
-        get_input("Package description", config->packages[0].description, sizeof(config->packages[0].description));
-    } else {
-        printf("\nEnter descriptions for each package:\n");
-        for (int i = 0; i < config->package_count; i++) {
-            char prompt[256];
-            snprintf(prompt, sizeof(prompt), "Description for %s", config->packages[i].name);
-            get_input(prompt, config->packages[i].description, sizeof(config->packages[i].description));
-        }
+    fclose(fp);
+    if (!sb.data) {
+        sb_append(&sb, "", 0);
     }
-    
-    // Get license information
-    if (config->package_count == 1) {
-        char license_input[MAX_LINE];
-        get_input("License(s) (comma-separated, e.g., 'GPL-3.0, MIT')", license_input, sizeof(license_input));
-        
-        // Parse comma-separated licenses
-        char *token = strtok(license_input, ",");
-        while (token && config->packages[0].license_count < MAX_DEPS) {
-            trim(token);
-            if (strlen(token) > 0) {
-                strcpy(config->packages[0].license[config->packages[0].license_count], token);
-                config->packages[0].license_count++;
-            }
-            token = strtok(NULL, ",");
-        }
-    } else {
-        printf("\nEnter licenses for each package:\n");
-        for (int i = 0; i < config->package_count; i++) {
-            char license_input[MAX_LINE];
-            char prompt[256];
-            snprintf(prompt, sizeof(prompt), "License(s) for %s (comma-separated)", config->packages[i].name);
-            get_input(prompt, license_input, sizeof(license_input));
-            
-            // Parse comma-separated licenses
-            char *token = strtok(license_input, ",");
-            while (token && config->packages[i].license_count < MAX_DEPS) {
-                trim(token);
-                if (strlen(token) > 0) {
-                    strcpy(config->packages[i].license[config->packages[i].license_count], token);
-                    config->packages[i].license_count++;
-                }
-                token = strtok(NULL, ",");
-            }
+    if (size) {
+        *size = sb.len;
+    }
+    return sb.data;
+}
+
+// Template functions
+//
+// A template is a text file of "key = value" lines, with scripts given as
+// "name <<END" heredocs. Keys use the STARBUILD variable names, including
+// the per-package "_<pkg>" suffixes. When templates are chained, each layer
+// is merged onto the previous ones: scalars replace, lists are unioned and
+// scripts are appended.
+#define TEMPLATE_DIR "templates"
+#define TEMPLATE_CACHE_DIR "templates/.cache"
+#define TEMPLATE_FORMAT_VERSION 1
+#define MAX_TEMPLATE_CHAIN 16
+
+void add_list_value(char array[][256], int *count, int max, const char *value) {
+    for (int i = 0; i < *count; i++) {
+        if (strcmp(array[i], value) == 0) {
+            return;
         }
     }
+    if (*count < max) {
+        snprintf(array[*count], 256, "%s", value);
+        (*count)++;
+    }
 }
 
-void wizard_dependencies(StarbuildConfig *config) {
-    print_header("Dependencies");
-    
-    char deps_input[MAX_LINE];
-    get_input("Global dependencies (comma-separated)", deps_input, sizeof(deps_input));
-    
-    // Parse comma-separated dependencies
-    char *token = strtok(deps_input, ",");
-    while (token && config->global_deps_count < MAX_DEPS) {
+// Parse a comma-separated list and union it into an array
+void add_list_values(char array[][256], int *count, int max, const char *input) {
+    TRACE_SCOPE("parse_list");
+    char buffer[MAX_LINE * 4];
+    snprintf(buffer, sizeof(buffer), "%s", input);
+
+    char *saveptr = NULL;
+    char *token = strtok_r(buffer, ",", &saveptr);
+    while (token) {
         trim(token);
         if (strlen(token) > 0) {
-            strcpy(config->global_deps[config->global_deps_count], token);
-            config->global_deps_count++;
+            add_list_value(array, count, max, token);
         }
-        token = strtok(NULL, ",");
+        token = strtok_r(NULL, ",", &saveptr);
     }
-    
-    char build_deps_input[MAX_LINE];
-    get_input("Build dependencies (comma-separated)", build_deps_input, sizeof(build_deps_input));
-    
-    token = strtok(build_deps_input, ",");
-    while (token && config->build_deps_count < MAX_DEPS) {
+}
+
+void add_source_values(char array[][512], int *count, int max, const char *input) {
+    char buffer[MAX_LINE * 4];
+    snprintf(buffer, sizeof(buffer), "%s", input);
+
+    char *saveptr = NULL;
+    char *token = strtok_r(buffer, ",", &saveptr);
+    while (token) {
         trim(token);
-        if (strlen(token) > 0) {
-            strcpy(config->build_deps[config->build_deps_count], token);
-            config->build_deps_count++;
+        int seen = 0;
+        for (int i = 0; i < *count; i++) {
+            if (strcmp(array[i], token) == 0) {
+                seen = 1;
+                break;
+            }
         }
-        token = strtok(NULL, ",");
+        if (strlen(token) > 0 && !seen && *count < max) {
+            snprintf(array[*count], 512, "%s", token);
+            (*count)++;
+        }
+        token = strtok_r(NULL, ",", &saveptr);
     }
-    
-    // For multiple packages, get package-specific dependencies
-    if (config->package_count > 1) {
-        printf("\nPackage-specific dependencies:\n");
-        for (int i = 0; i < config->package_count; i++) {
-            char pkg_deps[MAX_LINE];
-            char prompt[256];
-            snprintf(prompt, sizeof(prompt), "Additional dependencies for %s (comma-separated)", config->packages[i].name);
-            get_input(prompt, pkg_deps, sizeof(pkg_deps));
-            
-            token = strtok(pkg_deps, ",");
-            while (token && config->packages[i].deps_count < MAX_DEPS) {
-                trim(token);
-                if (strlen(token) > 0) {
-                    strcpy(config->packages[i].deps[config->packages[i].deps_count], token);
-                    config->packages[i].deps_count++;
+}
+
+// Options are unioned by name, so a later "!lto" overrides an earlier "lto"
+void add_option_values(StarbuildConfig *config, const char *input) {
+    char buffer[MAX_LINE * 4];
+    snprintf(buffer, sizeof(buffer), "%s", input);
+
+    char *saveptr = NULL;
+    char *token = strtok_r(buffer, ",", &saveptr);
+    while (token) {
+        trim(token);
+        if (strlen(token) > 0) {
+            const char *name = token[0] == '!' ? token + 1 : token;
+            int slot = -1;
+            for (int i = 0; i < config->options_count; i++) {
+                const char *existing = config->options[i][0] == '!' ? config->options[i] + 1 : config->options[i];
+                if (strcmp(existing, name) == 0) {
+                    slot = i;
+                    break;
                 }
-                token = strtok(NULL, ",");
+            }
+            if (slot < 0 && config->options_count < MAX_OPTIONS) {
+                slot = config->options_count++;
+            }
+            if (slot >= 0) {
+                snprintf(config->options[slot], sizeof(config->options[slot]), "%s", token);
             }
         }
+        token = strtok_r(NULL, ",", &saveptr);
     }
 }
 
-void wizard_sources(StarbuildConfig *config) {
-    print_header("Sources");
-    
-    char sources_input[MAX_LINE];
-    get_input("Source URLs (comma-separated)", sources_input, sizeof(sources_input));
-    
-    char *token = strtok(sources_input, ",");
-    while (token && config->sources_count < MAX_SOURCES) {
-        trim(token);
-        if (strlen(token) > 0) {
-            strcpy(config->sources[config->sources_count], token);
-            config->sources_count++;
+int find_package(StarbuildConfig *config, const char *name, int create) {
+    for (int i = 0; i < config->package_count; i++) {
+        if (strcmp(config->packages[i].name, name) == 0) {
+            return i;
         }
-        token = strtok(NULL, ",");
     }
+    if (!create || config->package_count >= MAX_PACKAGES) {
+        return -1;
+    }
+    snprintf(config->packages[config->package_count].name, sizeof(config->packages[0].name), "%s", name);
+    return config->package_count++;
 }
 
-void wizard_advanced_package_fields(StarbuildConfig *config) {
-    if (!config->enable_advanced_fields) {
-        return;
+void append_script_line(char script[][MAX_LINE_LENGTH], int *line_count, const char *line) {
+    // The wizard's placeholder is dropped as soon as real commands arrive
+    if (*line_count == 1 && strcmp(script[0], SCRIPT_PLACEHOLDER) == 0) {
+        *line_count = 0;
     }
-    
-    print_header("Advanced Package Fields");
-    
-    if (config->package_count == 1) {
-        // Single package - get advanced fields
-        char gives_input[MAX_LINE];
-        get_input("Gives (virtual packages, comma-separated)", gives_input, sizeof(gives_input));
-        
-        char *token = strtok(gives_input, ",");
-        while (token && config->packages[0].gives_count < MAX_DEPS) {
-            trim(token);
-            if (strlen(token) > 0) {
-                strcpy(config->packages[0].gives[config->packages[0].gives_count], token);
-                config->packages[0].gives_count++;
+    if (*line_count < MAX_SCRIPT_LINES) {
+        snprintf(script[*line_count], MAX_LINE_LENGTH, "%.*s", MAX_LINE_LENGTH - 1, line);
+        (*line_count)++;
+    }
+}
+
+// Map a script key (prepare, compile, verify, assemble, assemble_<pkg>) to its storage
+char (*template_script(StarbuildConfig *config, const char *key, int **line_count))[MAX_LINE_LENGTH] {
+    if (strcmp(key, "prepare") == 0) {
+        *line_count = &config->prepare_script_lines;
+        return config->prepare_script;
+    }
+    if (strcmp(key, "compile") == 0) {
+        *line_count = &config->compile_script_lines;
+        return config->compile_script;
+    }
+    if (strcmp(key, "verify") == 0) {
+        *line_count = &config->verify_script_lines;
+        return config->verify_script;
+    }
+
+    int pkg = -1;
+    if (strcmp(key, "assemble") == 0) {
+        pkg = 0;
+    } else if (strncmp(key, "assemble_", 9) == 0) {
+        pkg = find_package(config, key + 9, 1);
+    }
+    if (pkg < 0) {
+        return NULL;
+    }
+    *line_count = &config->assemble_script_lines[pkg];
+    return config->assemble_scripts[pkg];
+}
+
+int apply_template_value(StarbuildConfig *config, const char *key, const char *value) {
+    if (strcmp(key, "package_name") == 0) {
+        // Package names are a scalar as a whole: a later layer replaces the list
+        char names[MAX_PACKAGES][256];
+        int count = 0;
+        add_list_values(names, &count, MAX_PACKAGES, value);
+        if (count > 0) {
+            for (int i = 0; i < count; i++) {
+                strcpy(config->packages[i].name, names[i]);
             }
-            token = strtok(NULL, ",");
+            config->package_count = count;
         }
-        
-        char clashes_input[MAX_LINE];
-        get_input("Clashes (conflicting packages, comma-separated)", clashes_input, sizeof(clashes_input));
-        
-        token = strtok(clashes_input, ",");
-        while (token && config->packages[0].clashes_count < MAX_DEPS) {
-            trim(token);
-            if (strlen(token) > 0) {
-                strcpy(config->packages[0].clashes[config->packages[0].clashes_count], token);
-                config->packages[0].clashes_count++;
+    } else if (strcmp(key, "package_version") == 0) {
+        snprintf(config->packages[0].version, sizeof(config->packages[0].version), "%s", value);
+    } else if (strcmp(key, "description") == 0) {
+        snprintf(config->packages[0].description, sizeof(config->packages[0].description), "%s", value);
+    } else if (strcmp(key, "license") == 0) {
+        add_list_values(config->packages[0].license, &config->packages[0].license_count, MAX_DEPS, value);
+    } else if (strcmp(key, "dependencies") == 0) {
+        add_list_values(config->global_deps, &config->global_deps_count, MAX_DEPS, value);
+    } else if (strcmp(key, "build_dependencies") == 0) {
+        add_list_values(config->build_deps, &config->build_deps_count, MAX_DEPS, value);
+    } else if (strcmp(key, "sources") == 0) {
+        add_source_values(config->sources, &config->sources_count, MAX_SOURCES, value);
+    } else if (strcmp(key, "options") == 0) {
+        add_option_values(config, value);
+    } else if (strcmp(key, "gives") == 0) {
+        add_list_values(config->packages[0].gives, &config->packages[0].gives_count, MAX_DEPS, value);
+        config->enable_advanced_fields = 1;
+    } else if (strcmp(key, "clashes") == 0) {
+        add_list_values(config->packages[0].clashes, &config->packages[0].clashes_count, MAX_DEPS, value);
+        config->enable_advanced_fields = 1;
+    } else if (strcmp(key, "optional_dependencies") == 0) {
+        add_list_values(config->packages[0].optional_dependencies, &config->packages[0].optional_dependencies_count, MAX_DEPS, value);
+        config->enable_advanced_fields = 1;
+    } else if (strcmp(key, "provides") == 0) {
+        add_list_values(config->packages[0].provides, &config->packages[0].provides_count, MAX_DEPS, value);
+        config->enable_advanced_fields = 1;
+    } else if (strcmp(key, "conflicts") == 0) {
+        add_list_values(config->packages[0].conflicts, &config->packages[0].conflicts_count, MAX_DEPS, value);
+        config->enable_advanced_fields = 1;
+    } else {
+        // Per-package keys: <field>_<pkg>
+        const char *prefixes[] = { "description_", "license_", "dependencies_", "gives_", "clashes_", "optional_",
+                                   "provides_", "conflicts_" };
+        int field = -1;
+        for (int i = 0; i < (int)(sizeof(prefixes) / sizeof(prefixes[0])); i++) {
+            if (strncmp(key, prefixes[i], strlen(prefixes[i])) == 0) {
+                field = i;
+                break;
             }
-            token = strtok(NULL, ",");
         }
-        
-        char optional_deps_input[MAX_LINE];
-        get_input("Optional dependencies (comma-separated)", optional_deps_input, sizeof(optional_deps_input));
-        
-        token = strtok(optional_deps_input, ",");
-        while (token && config->packages[0].optional_dependencies_count < MAX_DEPS) {
-            trim(token);
-            if (strlen(token) > 0) {
-                strcpy(config->packages[0].optional_dependencies[config->packages[0].optional_dependencies_count], token);
-                config->packages[0].optional_dependencies_count++;
-            }
-            token = strtok(NULL, ",");
+        if (field < 0) {
+            return -1;
         }
-    } else {
-        // Multiple packages - get advanced fields for each
-        printf("\nAdvanced fields for each package:\n");
-        for (int i = 0; i < config->package_count; i++) {
-            printf("\nPackage: %s\n", config->packages[i].name);
-            
-            char gives_input[MAX_LINE];
-            char prompt[256];
-            snprintf(prompt, sizeof(prompt), "Gives for %s (comma-separated)", config->packages[i].name);
-            get_input(prompt, gives_input, sizeof(gives_input));
-            
-            char *token = strtok(gives_input, ",");
-            while (token && config->packages[i].gives_count < MAX_DEPS) {
-                trim(token);
-                if (strlen(token) > 0) {
-                    strcpy(config->packages[i].gives[config->packages[i].gives_count], token);
-                    config->packages[i].gives_count++;
-                }
-                token = strtok(NULL, ",");
-            }
-            
-            char clashes_input[MAX_LINE];
-            snprintf(prompt, sizeof(prompt), "Clashes for %s (comma-separated)", config->packages[i].name);
-            get_input(prompt, clashes_input, sizeof(clashes_input));
-            
-            token = strtok(clashes_input, ",");
-            while (token && config->packages[i].clashes_count < MAX_DEPS) {
-                trim(token);
-                if (strlen(token) > 0) {
-                    strcpy(config->packages[i].clashes[config->packages[i].clashes_count], token);
-                    config->packages[i].clashes_count++;
-                }
-                token = strtok(NULL, ",");
-            }
-            
-            char optional_deps_input[MAX_LINE];
-            snprintf(prompt, sizeof(prompt), "Optional dependencies for %s (comma-separated)", config->packages[i].name);
-            get_input(prompt, optional_deps_input, sizeof(optional_deps_input));
-            
-            token = strtok(optional_deps_input, ",");
-            while (token && config->packages[i].optional_dependencies_count < MAX_DEPS) {
-                trim(token);
-                if (strlen(token) > 0) {
-                    strcpy(config->packages[i].optional_dependencies[config->packages[i].optional_dependencies_count], token);
-                    config->packages[i].optional_dependencies_count++;
-                }
-                token = strtok(NULL, ",");
-            }
+
+        int pkg = find_package(config, key + strlen(prefixes[field]), 1);
+        if (pkg < 0) {
+            return -1;
+        }
+        Package *p = &config->packages[pkg];
+        switch (field) {
+            case 0:
+                snprintf(p->description, sizeof(p->description), "%s", value);
+                break;
+            case 1:
+                add_list_values(p->license, &p->license_count, MAX_DEPS, value);
+                break;
+            case 2:
+                add_list_values(p->deps, &p->deps_count, MAX_DEPS, value);
+                break;
+            case 3:
+                add_list_values(p->gives, &p->gives_count, MAX_DEPS, value);
+                config->enable_advanced_fields = 1;
+                break;
+            case 4:
+                add_list_values(p->clashes, &p->clashes_count, MAX_DEPS, value);
+                config->enable_advanced_fields = 1;
+                break;
+            case 5:
+                add_list_values(p->optional_dependencies, &p->optional_dependencies_count, MAX_DEPS, value);
+                config->enable_advanced_fields = 1;
+                break;
+            case 6:
+                add_list_values(p->provides, &p->provides_count, MAX_DEPS, value);
+                config->enable_advanced_fields = 1;
+                break;
+            case 7:
+                add_list_values(p->conflicts, &p->conflicts_count, MAX_DEPS, value);
+                config->enable_advanced_fields = 1;
+                break;
         }
     }
+    return 0;
 }
 
-void wizard_scripts(StarbuildConfig *config) {
-    print_header("Build Scripts");
-    
-    printf("Enter the build scripts (multi-line, press Enter twice to finish each script):\n\n");
-    
-    // Get prepare script
-    get_multiline_input("Prepare script (e.g., 'cd \"${srcdir}\"')", config->prepare_script, &config->prepare_script_lines);
-    
-    // Get compile script
-    get_multiline_input("Compile script (e.g., 'make -j$(nproc)')", config->compile_script, &config->compile_script_lines);
+// Copy one line of a mapped file into buf, trimmed. Returns the start of the
+// next line and sets *too_long if the line did not fit.
+const char *next_template_line(const char *line, const char *end, char *buf, size_t size, int *too_long) {
+    const char *eol = memchr(line, '\n', end - line);
+    size_t len = (eol ? eol : end) - line;
+    *too_long = len >= size;
+    if (*too_long) {
+        len = size - 1;
+    }
+    memcpy(buf, line, len);
+    buf[len] = '\0';
+    trim(buf);
+    return eol ? eol + 1 : end;
+}
+
+// Merge one template file into the config; returns -1 if it cannot be read
+int apply_template_file(const char *filename, StarbuildConfig *config) {
+    TRACE_SCOPE("apply_template_file");
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    const char *data = st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+
+    const char *end = data + st.st_size;
+    const char *next = data;
+    char line[MAX_LINE * 4];
+    char msg[MAX_LINE];
+    int line_number = 0;
+    int too_long;
+    while (next && next < end) {
+        next = next_template_line(next, end, line, sizeof(line), &too_long);
+        line_number++;
+        if (too_long) {
+            snprintf(msg, sizeof(msg), "%.500s:%d: line longer than %d characters truncated", filename, line_number, (int)sizeof(line) - 1);
+            print_warning(msg);
+        }
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+
+        char *heredoc = strstr(line, "<<");
+        char *equals = strchr(line, '=');
+        if (heredoc && (!equals || heredoc < equals)) {
+            *heredoc = '\0';
+            char terminator[64];
+            snprintf(terminator, sizeof(terminator), "%s", heredoc + 2);
+            trim(terminator);
+            trim(line);
+
+            int *line_count = NULL;
+            char (*script)[MAX_LINE_LENGTH] = template_script(config, line, &line_count);
+            if (!script) {
+                snprintf(msg, sizeof(msg), "%.500s:%d: unknown script '%.200s'", filename, line_number, line);
+                print_warning(msg);
+            }
+
+            // Script lines are taken straight from the mapping up to the terminator
+            char script_line[MAX_LINE_LENGTH];
+            while (next < end) {
+                next = next_template_line(next, end, script_line, sizeof(script_line), &too_long);
+                line_number++;
+                if (strcmp(script_line, terminator) == 0) {
+                    break;
+                }
+                if (too_long) {
+                    snprintf(msg, sizeof(msg), "%.500s:%d: script line longer than %d characters truncated",
+                             filename, line_number, MAX_LINE_LENGTH - 1);
+                    print_warning(msg);
+                }
+                if (script && script_line[0]) {
+                    if (*line_count >= MAX_SCRIPT_LINES) {
+                        snprintf(msg, sizeof(msg), "%.500s:%d: more than %d script lines, the rest dropped",
+                                 filename, line_number, MAX_SCRIPT_LINES);
+                        print_warning(msg);
+                        script = NULL;
+                        continue;
+                    }
+                    append_script_line(script, line_count, script_line);
+                }
+            }
+        } else if (equals) {
+            *equals = '\0';
+            char *value = equals + 1;
+            trim(line);
+            trim(value);
+            if (apply_template_value(config, line, value) < 0) {
+                snprintf(msg, sizeof(msg), "%.500s:%d: unknown key '%.200s'", filename, line_number, line);
+                print_warning(msg);
+            }
+        }
+    }
+
+    if (data) {
+        munmap((void *)data, st.st_size);
+    }
+    return 0;
+}
+
+void write_template_list(FILE *fp, const char *key, char array[][256], int count) {
+    if (count == 0) {
+        return;
+    }
+    fprintf(fp, "%s = ", key);
+    for (int i = 0; i < count; i++) {
+        fprintf(fp, "%s%s", i ? ", " : "", array[i]);
+    }
+    fprintf(fp, "\n");
+}
+
+void write_template_script(FILE *fp, const char *key, char script[][MAX_LINE_LENGTH], int line_count) {
+    if (line_count == 0 || (line_count == 1 && strcmp(script[0], SCRIPT_PLACEHOLDER) == 0)) {
+        return;
+    }
+    // The reader compares trimmed lines, so pick a delimiter no trimmed line equals
+    char delimiter[32] = "END";
+    for (int attempt = 1, clash = 1; clash; attempt++) {
+        clash = 0;
+        for (int i = 0; i < line_count && !clash; i++) {
+            const char *line = script[i];
+            size_t len = strlen(line);
+            while (len > 0 && isspace((unsigned char)*line)) {
+                line++;
+                len--;
+            }
+            while (len > 0 && isspace((unsigned char)line[len - 1])) {
+                len--;
+            }
+            clash = len == strlen(delimiter) && memcmp(line, delimiter, len) == 0;
+        }
+        if (clash) {
+            snprintf(delimiter, sizeof(delimiter), "END_%d", attempt);
+        }
+    }
+    fprintf(fp, "%s <<%s\n", key, delimiter);
+    for (int i = 0; i < line_count; i++) {
+        fprintf(fp, "%s\n", script[i]);
+    }
+    fprintf(fp, "%s\n", delimiter);
+}
+
+int write_template_file(const char *filename, StarbuildConfig *config) {
+    FILE *fp = fopen(filename, "w");
+    if (!fp) {
+        return -1;
+    }
+
+    fprintf(fp, "# Template generated by StarbuildCreator\n");
+    if (config->package_count > 0) {
+        fprintf(fp, "package_name = ");
+        for (int i = 0; i < config->package_count; i++) {
+            fprintf(fp, "%s%s", i ? ", " : "", config->packages[i].name);
+        }
+        fprintf(fp, "\n");
+    }
+    if (config->packages[0].version[0]) {
+        fprintf(fp, "package_version = %s\n", config->packages[0].version);
+    }
+
+    int packages = config->package_count > 0 ? config->package_count : 1;
+    for (int i = 0; i < packages; i++) {
+        Package *p = &config->packages[i];
+        char key[300];
+        const char *suffix = i == 0 && config->package_count <= 1 ? "" : p->name;
+        const char *sep = suffix[0] ? "_" : "";
+
+        if (p->description[0]) {
+            fprintf(fp, "description%s%s = %s\n", sep, suffix, p->description);
+        }
+        snprintf(key, sizeof(key), "license%s%s", sep, suffix);
+        write_template_list(fp, key, p->license, p->license_count);
+        if (suffix[0]) {
+            snprintf(key, sizeof(key), "dependencies_%s", suffix);
+            write_template_list(fp, key, p->deps, p->deps_count);
+        }
+        snprintf(key, sizeof(key), "gives%s%s", sep, suffix);
+        write_template_list(fp, key, p->gives, p->gives_count);
+        snprintf(key, sizeof(key), "clashes%s%s", sep, suffix);
+        write_template_list(fp, key, p->clashes, p->clashes_count);
+        snprintf(key, sizeof(key), "provides%s%s", sep, suffix);
+        write_template_list(fp, key, p->provides, p->provides_count);
+        snprintf(key, sizeof(key), "conflicts%s%s", sep, suffix);
+        write_template_list(fp, key, p->conflicts, p->conflicts_count);
+        snprintf(key, sizeof(key), "%s%s", suffix[0] ? "optional_" : "optional_dependencies", suffix);
+        write_template_list(fp, key, p->optional_dependencies, p->optional_dependencies_count);
+    }
+
+    write_template_list(fp, "dependencies", config->global_deps, config->global_deps_count);
+    write_template_list(fp, "build_dependencies", config->build_deps, config->build_deps_count);
+    if (config->sources_count > 0) {
+        fprintf(fp, "sources = ");
+        for (int i = 0; i < config->sources_count; i++) {
+            fprintf(fp, "%s%s", i ? ", " : "", config->sources[i]);
+        }
+        fprintf(fp, "\n");
+    }
+    write_template_list(fp, "options", config->options, config->options_count);
+
+    write_template_script(fp, "prepare", config->prepare_script, config->prepare_script_lines);
+    write_template_script(fp, "compile", config->compile_script, config->compile_script_lines);
+    write_template_script(fp, "verify", config->verify_script, config->verify_script_lines);
+    for (int i = 0; i < packages; i++) {
+        char key[300];
+        if (config->package_count <= 1) {
+            snprintf(key, sizeof(key), "assemble");
+        } else {
+            snprintf(key, sizeof(key), "assemble_%s", config->packages[i].name);
+        }
+        write_template_script(fp, key, config->assemble_scripts[i], config->assemble_script_lines[i]);
+    }
+
+    int ok = !ferror(fp);
+    return fclose(fp) == 0 && ok ? 0 : -1;
+}
+
+// Remove the entries a chain left behind before its layers last changed, so
+// the cache holds one entry per chain however often templates are edited
+void prune_template_cache(uint64_t chain, const char *keep) {
+    DIR *dir = opendir(TEMPLATE_CACHE_DIR);
+    if (!dir) {
+        return;
+    }
+    char prefix[32];
+    snprintf(prefix, sizeof(prefix), "%016llx-", (unsigned long long)chain);
+    const char *keep_name = strrchr(keep, '/') + 1;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        // Leave other chains, and scratch files another writer is still filling
+        if (strncmp(entry->d_name, prefix, strlen(prefix)) != 0 || len < 9 ||
+            strcmp(entry->d_name + len - 9, ".template") != 0 || strcmp(entry->d_name, keep_name) == 0) {
+            continue;
+        }
+        char path[600];
+        snprintf(path, sizeof(path), TEMPLATE_CACHE_DIR "/%.256s", entry->d_name);
+        unlink(path);
+    }
+    closedir(dir);
+}
+
+// Split a comma-separated template chain into its layer names
+int split_template_chain(const char *template_chain, char names[][256], int max) {
+    char chain[MAX_LINE];
+    snprintf(chain, sizeof(chain), "%s", template_chain);
+
+    int name_count = 0;
+    char *saveptr = NULL;
+    char *token = strtok_r(chain, ",", &saveptr);
+    while (token && name_count < max) {
+        trim(token);
+        if (strlen(token) > 0) {
+            snprintf(names[name_count++], 256, "%s", token);
+        }
+        token = strtok_r(NULL, ",", &saveptr);
+    }
+    return name_count;
+}
+
+// Resolve a chain of templates into the config, reusing a cached merge when
+// none of the template files have changed since it was written. Returns the
+// number of layers found.
+int resolve_templates(const char *template_chain, StarbuildConfig *config, int *cache_hit) {
+    TRACE_SCOPE("resolve_templates");
+    char names[MAX_TEMPLATE_CHAIN][256];
+    int name_count = split_template_chain(template_chain, names, MAX_TEMPLATE_CHAIN);
+    *cache_hit = 0;
+
+    // The cache key covers each layer's name, size and mtime, in chain order.
+    // Entries are named <chain>-<key> so stale ones for a chain can be found.
+    uint64_t key = fnv1a64("starbuild-template", 18, 0xcbf29ce484222325ULL);
+    int version = TEMPLATE_FORMAT_VERSION;
+    key = fnv1a64(&version, sizeof(version), key);
+    uint64_t chain_key = key;
+    int found = 0;
+    for (int i = 0; i < name_count; i++) {
+        char filename[512];
+        snprintf(filename, sizeof(filename), TEMPLATE_DIR "/%.255s.template", names[i]);
+        key = fnv1a64(names[i], strlen(names[i]) + 1, key);
+        chain_key = fnv1a64(names[i], strlen(names[i]) + 1, chain_key);
+
+        struct stat st;
+        if (stat(filename, &st) == 0) {
+            int64_t stamp[4] = { (int64_t)st.st_size, (int64_t)st.st_mtim.tv_sec, (int64_t)st.st_mtim.tv_nsec, (int64_t)st.st_ino };
+            key = fnv1a64(stamp, sizeof(stamp), key);
+            found++;
+        } else {
+            int64_t missing = -1;
+            key = fnv1a64(&missing, sizeof(missing), key);
+        }
+    }
+    if (found == 0) {
+        return 0;
+    }
+
+    char cache_file[512];
+    snprintf(cache_file, sizeof(cache_file), TEMPLATE_CACHE_DIR "/%016llx-%016llx.template",
+             (unsigned long long)chain_key, (unsigned long long)key);
+    if (apply_template_file(cache_file, config) == 0) {
+        TRACE_COUNT(cache_hits, 1);
+        *cache_hit = 1;
+        return found;
+    }
+
+    // Resolve into a scratch config so the cache holds only the merged templates
+    StarbuildConfig *resolved = calloc(1, sizeof(StarbuildConfig));
+    if (!resolved) {
+        print_error("Out of memory");
+        return 0;
+    }
+    for (int i = 0; i < name_count; i++) {
+        char filename[512];
+        snprintf(filename, sizeof(filename), TEMPLATE_DIR "/%.255s.template", names[i]);
+        if (apply_template_file(filename, resolved) < 0) {
+            char msg[600];
+            snprintf(msg, sizeof(msg), "Template '%.255s' not found, skipping", names[i]);
+            print_warning(msg);
+        }
+    }
+
+    char temp_file[600];
+    mkdir(TEMPLATE_CACHE_DIR, 0755);
+    snprintf(temp_file, sizeof(temp_file), "%s.%d", cache_file, (int)getpid());
+    if (write_template_file(temp_file, resolved) == 0) {
+        rename(temp_file, cache_file);
+        prune_template_cache(chain_key, cache_file);
+    } else {
+        unlink(temp_file);
+    }
+
+    if (apply_template_file(cache_file, config) < 0) {
+        // Cache directory not writable; fall back to merging the layers directly
+        for (int i = 0; i < name_count; i++) {
+            char filename[512];
+            snprintf(filename, sizeof(filename), TEMPLATE_DIR "/%.255s.template", names[i]);
+            apply_template_file(filename, config);
+        }
+    }
+    free(resolved);
+    return found;
+}
+
+void load_template(const char *template_chain, StarbuildConfig *config) {
+    int cache_hit = 0;
+    if (resolve_templates(template_chain, config, &cache_hit) == 0) {
+        print_warning("Template not found, using defaults");
+        return;
+    }
+    print_success(cache_hit ? "Template loaded (cached)" : "Template loaded");
+}
+
+void save_template(const char *template_name, StarbuildConfig *config) {
+    char filename[512];
+    snprintf(filename, sizeof(filename), TEMPLATE_DIR "/%.255s.template", template_name);
     
-    // Get verify script
-    get_multiline_input("Verify script (e.g., 'make check')", config->verify_script, &config->verify_script_lines);
+    // Create templates directory if it doesn't exist
+    mkdir(TEMPLATE_DIR, 0755);
     
-    // Get assemble script(s)
-    if (config->package_count == 1) {
-        printf("\nAssemble script for %s:\n", config->packages[0].name);
-        get_multiline_input("Assemble script (e.g., 'make DESTDIR=\"${pkgdir}\" install')", config->assemble_scripts[0], &config->assemble_script_lines[0]);
+    if (write_template_file(filename, config) < 0) {
+        print_error("Could not save template");
+        return;
+    }
+    print_success("Template saved");
+}
+
+// Shared helpers for the bulk modes
+typedef struct {
+    char **paths;
+    int count;
+    int capacity;
+} PathList;
+
+void path_list_add(PathList *list, const char *path) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->paths = realloc(list->paths, list->capacity * sizeof(char *));
+    }
+    list->paths[list->count++] = strdup(path);
+}
+
+void path_list_free(PathList *list) {
+    for (int i = 0; i < list->count; i++) {
+        free(list->paths[i]);
+    }
+    free(list->paths);
+    memset(list, 0, sizeof(*list));
+}
+
+// Recursively collect files named `filename` (or every file if NULL)
+void collect_files(const char *dir, const char *filename, PathList *list) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+            strcmp(entry->d_name, ".git") == 0) {
+            continue;
+        }
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+
+        int is_dir = entry->d_type == DT_DIR;
+        int is_file = entry->d_type == DT_REG;
+        if (entry->d_type == DT_UNKNOWN) {
+            struct stat st;
+            if (lstat(path, &st) == 0) {
+                is_dir = S_ISDIR(st.st_mode);
+                is_file = S_ISREG(st.st_mode);
+            }
+        }
+        if (is_dir) {
+            collect_files(path, filename, list);
+        } else if (is_file && (!filename || strcmp(entry->d_name, filename) == 0)) {
+            path_list_add(list, path);
+        }
+    }
+    closedir(d);
+}
+
+typedef void (*WorkFunction)(void *context, int index);
+
+typedef struct {
+    WorkFunction work;
+    void *context;
+    int count;
+    int next;
+    pthread_mutex_t lock;
+} WorkQueue;
+
+void *work_queue_thread(void *arg) {
+    WorkQueue *queue = arg;
+    while (1) {
+        pthread_mutex_lock(&queue->lock);
+        int index = queue->next++;
+        pthread_mutex_unlock(&queue->lock);
+        if (index >= queue->count) {
+            break;
+        }
+        queue->work(queue->context, index);
+    }
+    return NULL;
+}
+
+int default_thread_count() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+}
+
+// Run work(context, i) for every i in [0, count) on up to `threads` threads
+void parallel_for(int count, int threads, WorkFunction work, void *context) {
+    WorkQueue queue = { work, context, count, 0, PTHREAD_MUTEX_INITIALIZER };
+    if (threads > count) {
+        threads = count;
+    }
+    if (threads <= 1) {
+        work_queue_thread(&queue);
+        return;
+    }
+
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+    int started = 0;
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&workers[started], NULL, work_queue_thread, &queue) == 0) {
+            started++;
+        }
+    }
+    if (started == 0) {
+        work_queue_thread(&queue);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+}
+
+// Source archive inspection
+//
+// Local tarballs listed in sources are streamed through their decompressor
+// and only the tar headers plus a few small top-level files are read, so the
+// wizard can prefill a recipe without unpacking the archive to disk.
+#define TAR_BLOCK 512
+#define TAR_MAX_MEMBER (256 * 1024)
+#define MAX_LICENSE_FILES 8
+
+// Called for each regular file and directory (named with a trailing slash):
+// return how many bytes of a file to receive (at most TAR_MAX_MEMBER; 0 skips
+// it), or -1 to stop reading the archive
+typedef int (*TarWantFunction)(void *context, const char *name, uint64_t size);
+// Called with the contents of a wanted file: return -1 to stop reading
+typedef int (*TarDataFunction)(void *context, const char *name, const char *data, size_t size);
+
+typedef struct {
+    const char *archive;
+    char top_dir[256];
+    char name[256];
+    char version[64];
+    char build_system[32];
+    char build_file[64];
+    char license_files[MAX_LICENSE_FILES][256];
+    int license_file_count;
+    int entries;
+    int stopped;
+} SourceInfo;
+
+// Decompressor for an archive name ("" for plain tar), or NULL if it is not a tarball
+const char *tar_decompressor(const char *path) {
+    static const char *table[][2] = {
+        {".tar.gz", "gzip"}, {".tgz", "gzip"},
+        {".tar.xz", "xz"}, {".txz", "xz"},
+        {".tar.zst", "zstd"}, {".tzst", "zstd"},
+        {".tar.bz2", "bzip2"}, {".tbz2", "bzip2"},
+        {".tar", ""},
+    };
+    size_t len = strlen(path);
+    for (size_t i = 0; i < sizeof(table) / sizeof(table[0]); i++) {
+        size_t suffix_len = strlen(table[i][0]);
+        if (len > suffix_len && strcasecmp(path + len - suffix_len, table[i][0]) == 0) {
+            return table[i][1];
+        }
+    }
+    return NULL;
+}
+
+// Start the decompressor and return a descriptor to read the tar stream from
+int tar_open(const char *path, pid_t *child) {
+    const char *command = tar_decompressor(path);
+    *child = -1;
+    if (!command) {
+        return -1;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || command[0] == '\0') {
+        return fd;
+    }
+
+    int pipefd[2];
+    if (pipe(pipefd) < 0) {
+        close(fd);
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fd);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        // Closing the pipe early is how we stop, so keep the broken pipe quiet
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(fd, STDIN_FILENO);
+        dup2(pipefd[1], STDOUT_FILENO);
+        if (devnull >= 0) {
+            dup2(devnull, STDERR_FILENO);
+        }
+        close(fd);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        execlp(command, command, "-dc", (char *)NULL);
+        _exit(127);
+    }
+    close(fd);
+    close(pipefd[1]);
+    *child = pid;
+    return pipefd[0];
+}
+
+// Read exactly `size` bytes unless the stream ends first
+size_t read_full(int fd, void *buffer, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = read(fd, (char *)buffer + done, size - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+int tar_skip(int fd, uint64_t size) {
+    char buffer[65536];
+    while (size > 0) {
+        size_t chunk = size < sizeof(buffer) ? size : sizeof(buffer);
+        if (read_full(fd, buffer, chunk) != chunk) {
+            return -1;
+        }
+        size -= chunk;
+    }
+    return 0;
+}
+
+// Numeric header fields are octal, or base-256 when the top bit is set
+uint64_t tar_number(const unsigned char *field, int len) {
+    uint64_t value = 0;
+    if (field[0] & 0x80) {
+        value = field[0] & 0x7f;
+        for (int i = 1; i < len; i++) {
+            value = (value << 8) | field[i];
+        }
+        return value;
+    }
+    for (int i = 0; i < len && field[i]; i++) {
+        if (field[i] >= '0' && field[i] <= '7') {
+            value = value * 8 + (field[i] - '0');
+        }
+    }
+    return value;
+}
+
+int tar_checksum_ok(const unsigned char *header) {
+    unsigned sum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++) {
+        sum += (i >= 148 && i < 156) ? ' ' : header[i];
+    }
+    return sum == tar_number(header + 148, 8);
+}
+
+// Pull the "path" record out of a pax extended header
+void tar_pax_path(const char *data, size_t size, char *path, size_t path_size) {
+    const char *p = data;
+    const char *end = data + size;
+    while (p < end) {
+        char *record;
+        unsigned long len = strtoul(p, &record, 10);
+        if (len == 0 || record == p || p + len > end) {
+            return;
+        }
+        if (strncmp(record, " path=", 6) == 0) {
+            int value_len = (int)(p + len - (record + 6) - 1);
+            snprintf(path, path_size, "%.*s", value_len, record + 6);
+        }
+        p += len;
+    }
+}
+
+// Stream a tarball, handing each regular file to `want`/`data`. Returns 0
+// when the archive was read to the end or the callbacks stopped it, -1 on error.
+int tar_read(const char *path, TarWantFunction want, TarDataFunction data, void *context) {
+    pid_t child;
+    int fd = tar_open(path, &child);
+    if (fd < 0) {
+        return -1;
+    }
+
+    unsigned char header[TAR_BLOCK];
+    char long_name[4096] = "";
+    char *buffer = malloc(TAR_MAX_MEMBER + TAR_BLOCK + 1);
+    int ok = 1;
+    int stopped = 0;
+    while (ok && !stopped) {
+        if (read_full(fd, header, TAR_BLOCK) != TAR_BLOCK) {
+            ok = 0;
+            break;
+        }
+        if (header[0] == '\0') {
+            // End of archive; whatever follows is record padding
+            stopped = 1;
+            break;
+        }
+        if (!tar_checksum_ok(header)) {
+            ok = 0;
+            break;
+        }
+
+        uint64_t size = tar_number(header + 124, 12);
+        uint64_t padded = (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+        char type = header[156];
+        char name[4096];
+        if (long_name[0]) {
+            snprintf(name, sizeof(name), "%s", long_name);
+            long_name[0] = '\0';
+        } else if (memcmp(header + 257, "ustar", 5) == 0 && header[345]) {
+            snprintf(name, sizeof(name), "%.155s/%.100s", header + 345, header);
+        } else {
+            snprintf(name, sizeof(name), "%.100s", header);
+        }
+
+        // GNU long names and pax headers describe the entry that follows
+        if (type == 'L' || type == 'x') {
+            if (size > TAR_MAX_MEMBER || read_full(fd, buffer, padded) != padded) {
+                ok = 0;
+                break;
+            }
+            buffer[size] = '\0';
+            if (type == 'L') {
+                snprintf(long_name, sizeof(long_name), "%s", buffer);
+            } else {
+                tar_pax_path(buffer, size, long_name, sizeof(long_name));
+            }
+            continue;
+        }
+
+        const char *member = strncmp(name, "./", 2) == 0 ? name + 2 : name;
+        int regular = type == '0' || type == '\0' || type == '7';
+        size_t member_len = strlen(member);
+        if (type == '5' && member_len > 0 && member[member_len - 1] != '/' && member_len + 1 < sizeof(name)) {
+            // Directories always reach `want` with their trailing slash
+            name[member - name + member_len] = '/';
+            name[member - name + member_len + 1] = '\0';
+        }
+        int limit = 0;
+        if ((regular || type == '5') && member[0]) {
+            limit = want(context, member, regular ? size : 0);
+        }
+        if (!regular && limit > 0) {
+            limit = 0;
+        }
+        if (limit < 0) {
+            stopped = 1;
+            break;
+        }
+        uint64_t length = size < (uint64_t)limit ? size : (uint64_t)limit;
+        if (length > TAR_MAX_MEMBER) {
+            length = TAR_MAX_MEMBER;
+        }
+        if (length > 0) {
+            if (read_full(fd, buffer, length) != length) {
+                ok = 0;
+                break;
+            }
+            buffer[length] = '\0';
+            stopped = data(context, member, buffer, length) < 0;
+        }
+        if (!stopped && tar_skip(fd, padded - length) < 0) {
+            ok = 0;
+        }
+    }
+    free(buffer);
+    close(fd);
+
+    if (child > 0) {
+        int status = 0;
+        if (stopped) {
+            kill(child, SIGTERM);
+        }
+        waitpid(child, &status, 0);
+        if (!stopped && !(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+            ok = 0;
+        }
+    }
+    return ok ? 0 : -1;
+}
+
+// Copy a version-looking token (it must start with a digit)
+int take_version(const char *p, char *version, size_t size) {
+    if (*p == 'v' && isdigit((unsigned char)p[1])) {
+        p++;
+    }
+    if (!isdigit((unsigned char)*p)) {
+        return 0;
+    }
+    size_t len = 0;
+    while ((isalnum((unsigned char)p[len]) || strchr("._+~", p[len])) && p[len]) {
+        len++;
+    }
+    while (len > 0 && p[len - 1] == '.') {
+        len--;
+    }
+    snprintf(version, size, "%.*s", (int)len, p);
+    return 1;
+}
+
+int is_word_char(char c) {
+    return isalnum((unsigned char)c) || c == '_';
+}
+
+// Find `word` in [start, end) where it is not part of a longer identifier
+const char *find_word(const char *start, const char *end, const char *word, int ignore_case) {
+    size_t len = strlen(word);
+    for (const char *p = start; p + len <= end; p++) {
+        int match = ignore_case ? strncasecmp(p, word, len) == 0 : strncmp(p, word, len) == 0;
+        if (match && (p == start || !is_word_char(p[-1])) && (p + len == end || !is_word_char(p[len]))) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+const char *skip_spaces(const char *p, const char *end) {
+    while (p < end && isspace((unsigned char)*p)) {
+        p++;
+    }
+    return p;
+}
+
+// Find the argument list of the first call to `function`, returning its end
+const char *find_call(const char *text, const char *end, const char *function, int ignore_case, const char **args) {
+    const char *p = text;
+    while ((p = find_word(p, end, function, ignore_case)) != NULL) {
+        p = skip_spaces(p + strlen(function), end);
+        if (p < end && *p == '(') {
+            const char *close = memchr(p, ')', end - p);
+            *args = p + 1;
+            return close ? close : end;
+        }
+    }
+    return NULL;
+}
+
+// project(foo VERSION 1.2.3) in CMakeLists.txt
+int version_from_cmake(const char *text, size_t size, char *version, size_t version_size) {
+    const char *args;
+    const char *close = find_call(text, text + size, "project", 1, &args);
+    const char *p = close ? find_word(args, close, "VERSION", 0) : NULL;
+    return p && take_version(skip_spaces(p + 7, close), version, version_size);
+}
+
+// project('foo', 'c', version : '1.2.3') in meson.build
+int version_from_meson(const char *text, size_t size, char *version, size_t version_size) {
+    const char *args;
+    const char *close = find_call(text, text + size, "project", 0, &args);
+    const char *p = close ? find_word(args, close, "version", 0) : NULL;
+    if (!p) {
+        return 0;
+    }
+    p = skip_spaces(p + 7, close);
+    if (p >= close || *p != ':') {
+        return 0;
+    }
+    p = skip_spaces(p + 1, close);
+    return p < close && (*p == '\'' || *p == '"') && take_version(p + 1, version, version_size);
+}
+
+// AC_INIT([foo], [1.2.3]) in configure.ac
+int version_from_autoconf(const char *text, size_t size, char *version, size_t version_size) {
+    const char *args;
+    const char *close = find_call(text, text + size, "AC_INIT", 0, &args);
+    const char *p = close ? memchr(args, ',', close - args) : NULL;
+    if (!p) {
+        return 0;
+    }
+    p = skip_spaces(p + 1, close);
+    if (p < close && *p == '[') {
+        p++;
+    }
+    return take_version(p, version, version_size);
+}
+
+// version = "1.2.3" under [project] or [tool.poetry] in pyproject.toml
+int version_from_pyproject(const char *text, size_t size, char *version, size_t version_size) {
+    const char *end = text + size;
+    int in_project = 0;
+    for (const char *line = text; line < end; ) {
+        const char *eol = memchr(line, '\n', end - line);
+        if (!eol) {
+            eol = end;
+        }
+        const char *p = skip_spaces(line, eol);
+        if (p < eol && *p == '[') {
+            in_project = strncmp(p, "[project]", 9) == 0 || strncmp(p, "[tool.poetry]", 13) == 0;
+        } else if (in_project && find_word(p, eol, "version", 0) == p) {
+            p = skip_spaces(p + 7, eol);
+            if (p < eol && *p == '=') {
+                p = skip_spaces(p + 1, eol);
+                if (p < eol && (*p == '"' || *p == '\'') && take_version(p + 1, version, version_size)) {
+                    return 1;
+                }
+            }
+        }
+        line = eol + 1;
+    }
+    return 0;
+}
+
+// foo-1.2.3.tar.gz gives the name "foo" and version "1.2.3"
+void name_from_archive(SourceInfo *info) {
+    const char *base = strrchr(info->archive, '/');
+    base = base ? base + 1 : info->archive;
+    char stem[256];
+    snprintf(stem, sizeof(stem), "%s", base);
+    char *dot = strstr(stem, ".tar");
+    if (!dot) {
+        dot = strrchr(stem, '.');
+    }
+    if (dot) {
+        *dot = '\0';
+    }
+
+    for (char *p = stem + strlen(stem) - 1; p > stem; p--) {
+        if ((*p == '-' || *p == '_') && take_version(p + 1, info->version, sizeof(info->version))) {
+            *p = '\0';
+            break;
+        }
+    }
+    snprintf(info->name, sizeof(info->name), "%s", stem);
+}
+
+// Build files in order of preference when a tree ships more than one
+static const char *source_build_files[][2] = {
+    {"meson.build", "meson"},
+    {"CMakeLists.txt", "cmake"},
+    {"configure.ac", "autotools"},
+    {"configure.in", "autotools"},
+    {"pyproject.toml", "python"},
+};
+#define SOURCE_BUILD_FILE_COUNT (int)(sizeof(source_build_files) / sizeof(source_build_files[0]))
+
+int source_build_rank(const char *filename) {
+    for (int i = 0; i < SOURCE_BUILD_FILE_COUNT; i++) {
+        if (strcmp(filename, source_build_files[i][0]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int is_license_file(const char *filename) {
+    return strncasecmp(filename, "LICENSE", 7) == 0 || strncasecmp(filename, "LICENCE", 7) == 0 ||
+           strncasecmp(filename, "COPYING", 7) == 0;
+}
+
+// Return the file name if `member` sits directly in the archive's top
+// directory, which is the first path component of the first entry
+const char *source_top_level(SourceInfo *info, const char *member) {
+    const char *slash = strchr(member, '/');
+    if (info->entries == 1 && slash) {
+        snprintf(info->top_dir, sizeof(info->top_dir), "%.*s", (int)(slash - member), member);
+    }
+    size_t len = strlen(info->top_dir);
+    if (len > 0 && (strncmp(member, info->top_dir, len) != 0 || member[len] != '/')) {
+        // Not everything sits under that directory, so the archive is flat and
+        // what was taken from the first directory belongs to a subdirectory
+        info->top_dir[0] = '\0';
+        info->build_file[0] = '\0';
+        info->build_system[0] = '\0';
+        info->license_file_count = 0;
+        name_from_archive(info);
+        len = 0;
+    }
+    const char *filename = len > 0 ? member + len + 1 : member;
+    return filename[0] && !strchr(filename, '/') ? filename : NULL;
+}
+
+// Done once the most preferred kind of build file has been read; until then
+// a better one may still come later in the archive
+int source_info_done(SourceInfo *info) {
+    return info->build_file[0] && source_build_rank(info->build_file) == 0 && info->version[0] &&
+           info->license_file_count > 0;
+}
+
+int source_want(void *context, const char *member, uint64_t size) {
+    SourceInfo *info = context;
+    (void)size;
+    if (source_info_done(info)) {
+        info->stopped = 1;
+        return -1;
+    }
+    info->entries++;
+    const char *filename = source_top_level(info, member);
+    if (!filename) {
+        return 0;
+    }
+    if (is_license_file(filename) && info->license_file_count < MAX_LICENSE_FILES) {
+        snprintf(info->license_files[info->license_file_count++], sizeof(info->license_files[0]), "%s", filename);
+        return 0;
+    }
+    int rank = source_build_rank(filename);
+    int current = info->build_file[0] ? source_build_rank(info->build_file) : SOURCE_BUILD_FILE_COUNT;
+    return rank >= 0 && rank < current ? TAR_MAX_MEMBER : 0;
+}
+
+int source_data(void *context, const char *member, const char *data, size_t size) {
+    SourceInfo *info = context;
+    const char *filename = strrchr(member, '/');
+    filename = filename ? filename + 1 : member;
+    int rank = source_build_rank(filename);
+    snprintf(info->build_file, sizeof(info->build_file), "%s", filename);
+    snprintf(info->build_system, sizeof(info->build_system), "%s", source_build_files[rank][1]);
+
+    // A literal version in the build file beats one guessed from the archive name
+    char version[64] = "";
+    if (strcmp(info->build_system, "cmake") == 0) {
+        version_from_cmake(data, size, version, sizeof(version));
+    } else if (strcmp(info->build_system, "meson") == 0) {
+        version_from_meson(data, size, version, sizeof(version));
+    } else if (strcmp(info->build_system, "autotools") == 0) {
+        version_from_autoconf(data, size, version, sizeof(version));
+    } else {
+        version_from_pyproject(data, size, version, sizeof(version));
+    }
+    if (version[0]) {
+        snprintf(info->version, sizeof(info->version), "%s", version);
+    }
+    if (source_info_done(info)) {
+        info->stopped = 1;
+        return -1;
+    }
+    return 0;
+}
+
+// Inspect a local tarball; returns -1 if it cannot be read
+int inspect_source(const char *archive, SourceInfo *info) {
+    TRACE_SCOPE("inspect_source");
+    memset(info, 0, sizeof(*info));
+    info->archive = archive;
+    name_from_archive(info);
+    return tar_read(archive, source_want, source_data, info);
+}
+
+// Map a sources entry to a local tarball path, or return 0 if it is not one
+int source_archive_path(const char *source, char *path, size_t size) {
+    const char *rename = strstr(source, "::");
+    if (rename) {
+        source = rename + 2;
+    }
+    if (strstr(source, "://") || !tar_decompressor(source)) {
+        return 0;
+    }
+    snprintf(path, size, "%s", source);
+    return access(path, R_OK) == 0;
+}
+
+// Fill an empty script with the NULL-terminated lines, after `cd` if one is given
+void prefill_script(char script[][MAX_LINE_LENGTH], int *line_count, const char *cd, ...) {
+    if (*line_count > 0 && strcmp(script[0], SCRIPT_PLACEHOLDER) != 0) {
+        return;
+    }
+    if (cd[0]) {
+        append_script_line(script, line_count, cd);
+    }
+    va_list args;
+    va_start(args, cd);
+    const char *line;
+    while ((line = va_arg(args, const char *)) != NULL) {
+        append_script_line(script, line_count, line);
+    }
+    va_end(args);
+}
+
+// Default scripts for a detected build system; phases run from ${srcdir}
+void source_scripts(SourceInfo *info, const char *top, StarbuildConfig *config) {
+    char cd[MAX_LINE_LENGTH] = "";
+    char configure[MAX_LINE_LENGTH];
+    if (strcmp(top, ".") != 0) {
+        snprintf(cd, sizeof(cd), "cd \"%s\"", top);
+    }
+
+    if (strcmp(info->build_system, "cmake") == 0) {
+        snprintf(configure, sizeof(configure), "cmake -B build -S \"%s\" -DCMAKE_BUILD_TYPE=Release -DCMAKE_INSTALL_PREFIX=/usr", top);
+        prefill_script(config->compile_script, &config->compile_script_lines, "", configure, "cmake --build build", NULL);
+        prefill_script(config->verify_script, &config->verify_script_lines, "", "ctest --test-dir build --output-on-failure", NULL);
+        prefill_script(config->assemble_scripts[0], &config->assemble_script_lines[0], "", "DESTDIR=\"${pkgdir}\" cmake --install build", NULL);
+        add_list_values(config->build_deps, &config->build_deps_count, MAX_DEPS, "cmake");
+    } else if (strcmp(info->build_system, "meson") == 0) {
+        snprintf(configure, sizeof(configure), "meson setup build \"%s\" --prefix=/usr --buildtype=release", top);
+        prefill_script(config->compile_script, &config->compile_script_lines, "", configure, "meson compile -C build", NULL);
+        prefill_script(config->verify_script, &config->verify_script_lines, "", "meson test -C build", NULL);
+        prefill_script(config->assemble_scripts[0], &config->assemble_script_lines[0], "", "meson install -C build --destdir \"${pkgdir}\"", NULL);
+        add_list_values(config->build_deps, &config->build_deps_count, MAX_DEPS, "meson, ninja");
+    } else if (strcmp(info->build_system, "autotools") == 0) {
+        prefill_script(config->prepare_script, &config->prepare_script_lines, cd, "[ -x configure ] || autoreconf -fi", NULL);
+        prefill_script(config->compile_script, &config->compile_script_lines, cd, "./configure --prefix=/usr", "make -j$(nproc)", NULL);
+        prefill_script(config->verify_script, &config->verify_script_lines, cd, "make check", NULL);
+        prefill_script(config->assemble_scripts[0], &config->assemble_script_lines[0], cd, "make DESTDIR=\"${pkgdir}\" install", NULL);
+    } else if (strcmp(info->build_system, "python") == 0) {
+        prefill_script(config->compile_script, &config->compile_script_lines, cd, "python -m build --wheel --no-isolation", NULL);
+        prefill_script(config->assemble_scripts[0], &config->assemble_script_lines[0], cd, "python -m installer --destdir=\"${pkgdir}\" dist/*.whl", NULL);
+    }
+}
+
+// Prefill name, version, build dependencies and scripts from an inspected archive
+void apply_source_info(SourceInfo *info, StarbuildConfig *config) {
+    if (config->package_count == 0 && info->name[0]) {
+        apply_template_value(config, "package_name", info->name);
+    }
+    if (config->packages[0].version[0] == '\0' && info->version[0]) {
+        apply_template_value(config, "package_version", info->version);
+    }
+
+    // Keep the scripts working across version bumps
+    char top[256] = ".";
+    if (info->top_dir[0]) {
+        snprintf(top, sizeof(top), "%s", info->top_dir);
+        char *found = info->version[0] ? strstr(top, info->version) : NULL;
+        if (found) {
+            char rest[256];
+            snprintf(rest, sizeof(rest), "%s", found + strlen(info->version));
+            snprintf(found, sizeof(top) - (found - top), "${package_version}%s", rest);
+        }
+    }
+    source_scripts(info, top, config);
+}
+
+void print_source_info(SourceInfo *info) {
+    printf("  Build system: %s%s%s%s\n", info->build_system[0] ? info->build_system : "unknown",
+           info->build_file[0] ? " (" : "", info->build_file, info->build_file[0] ? ")" : "");
+    printf("  Version: %s\n", info->version[0] ? info->version : "unknown");
+    if (info->top_dir[0]) {
+        printf("  Top directory: %s\n", info->top_dir);
+    }
+    if (info->license_file_count > 0) {
+        printf("  License files:");
+        for (int i = 0; i < info->license_file_count; i++) {
+            printf(" %s", info->license_files[i]);
+        }
+        printf("\n");
+    }
+    printf("  Entries read: %d%s\n", info->entries, info->stopped ? " (stopped early)" : "");
+}
+
+int inspect_mode(int argc, char *argv[]) {
+    if (argc < 1) {
+        fprintf(stderr, "Usage: inspect ARCHIVE...\n");
+        return 1;
+    }
+    int failed = 0;
+    for (int i = 0; i < argc; i++) {
+        SourceInfo info;
+        printf("%s\n", argv[i]);
+        if (!tar_decompressor(argv[i])) {
+            print_error("Not a tarball (.tar, .tar.gz, .tar.xz, .tar.zst or .tar.bz2)");
+            failed = 1;
+            continue;
+        }
+        if (inspect_source(argv[i], &info) < 0) {
+            print_warning("Could not read the whole archive");
+            failed = 1;
+        }
+        print_source_info(&info);
+    }
+    return failed;
+}
+
+// License detection
+//
+// License files are matched against distinctive phrases of the common
+// license texts. The text is normalised to lower-case letters and digits
+// with every other run collapsed to one space, so rewrapping, comment
+// markers and punctuation do not matter, and all phrases are found in one
+// pass with an Aho-Corasick automaton. Other files only have their head
+// checked for SPDX-License-Identifier tags.
+#define LICENSE_HEAD_BYTES 4096
+#define LICENSE_MIN_CONFIDENCE 0.5
+#define LICENSE_MAX_PHRASES 128
+#define LICENSE_SYMBOLS 37
+
+typedef struct {
+    const char *id;
+    const char *phrases[5];
+} LicenseText;
+
+static const LicenseText license_corpus[] = {
+    {"MIT", {
+        "permission is hereby granted free of charge to any person obtaining a copy",
+        "the above copyright notice and this permission notice shall be included in all copies or substantial portions of the software",
+        "the software is provided as is without warranty of any kind express or implied"}},
+    {"ISC", {
+        "permission to use copy modify and or distribute this software for any purpose with or without fee is hereby granted",
+        "the software is provided as is and the author disclaims all warranties with regard to this software"}},
+    {"BSD-2-Clause", {
+        "redistribution and use in source and binary forms with or without modification are permitted provided that the following conditions are met",
+        "redistributions of source code must retain the above copyright notice this list of conditions and the following disclaimer",
+        "redistributions in binary form must reproduce the above copyright notice this list of conditions and the following disclaimer in the documentation and or other materials provided with the distribution"}},
+    {"BSD-3-Clause", {
+        "redistribution and use in source and binary forms with or without modification are permitted provided that the following conditions are met",
+        "redistributions of source code must retain the above copyright notice this list of conditions and the following disclaimer",
+        "redistributions in binary form must reproduce the above copyright notice this list of conditions and the following disclaimer in the documentation and or other materials provided with the distribution",
+        "may be used to endorse or promote products derived from this software without specific prior written permission"}},
+    {"Apache-2.0", {
+        "apache license version 2 0 january 2004",
+        "terms and conditions for use reproduction and distribution",
+        "grant of patent license",
+        "you may not use this file except in compliance with the license"}},
+    {"GPL-2.0-only", {
+        "gnu general public license version 2 june 1991",
+        "the licenses for most software are designed to take away your freedom to share and change it",
+        "this general public license does not permit incorporating your program into proprietary programs"}},
+    {"GPL-3.0-only", {
+        "gnu general public license version 3 29 june 2007",
+        "the gnu general public license is a free copyleft license for software and other kinds of works",
+        "this license explicitly affirms your unlimited permission to run the unmodified program"}},
+    {"LGPL-2.0-only", {
+        "gnu library general public license version 2 june 1991",
+        "this license the library general public license applies to some specially designated free software foundation software"}},
+    {"LGPL-2.1-only", {
+        "gnu lesser general public license version 2 1 february 1999",
+        "this license the lesser general public license applies to some specially designated software packages"}},
+    {"LGPL-3.0-only", {
+        "gnu lesser general public license version 3 29 june 2007",
+        "this version of the gnu lesser general public license incorporates the terms and conditions of version 3 of the gnu general public license"}},
+    {"AGPL-3.0-only", {
+        "gnu affero general public license version 3 19 november 2007",
+        "the gnu affero general public license is a free copyleft license for software and other kinds of works"}},
+    {"MPL-2.0", {
+        "mozilla public license version 2 0",
+        "covered software is provided under this license on an as is basis",
+        "each contributor hereby grants you a world wide royalty free non exclusive license"}},
+    {"Zlib", {
+        "this software is provided as is without any express or implied warranty in no event will the authors be held liable for any damages arising from the use of this software",
+        "the origin of this software must not be misrepresented",
+        "altered source versions must be plainly marked as such and must not be misrepresented as being the original software"}},
+    {"Unlicense", {
+        "this is free and unencumbered software released into the public domain",
+        "anyone is free to copy modify publish use compile sell or distribute this software"}},
+    {"BSL-1.0", {
+        "boost software license version 1 0 august 17th 2003",
+        "permission is hereby granted free of charge to any person or organization obtaining a copy of the software and accompanying documentation covered by this license"}},
+    {"CC0-1.0", {
+        "cc0 1 0 universal",
+        "the laws of most jurisdictions throughout the world automatically confer exclusive copyright and related rights"}},
+    {"EPL-2.0", {
+        "eclipse public license v 2 0",
+        "the accompanying program is provided under the terms of this eclipse public license"}},
+};
+#define LICENSE_CORPUS_COUNT (int)(sizeof(license_corpus) / sizeof(license_corpus[0]))
+
+typedef struct {
+    int next[LICENSE_SYMBOLS];
+    int fail;
+    int phrase;
+    int dict;
+} MatchState;
+
+typedef struct {
+    MatchState *states;
+    int state_count;
+    int state_capacity;
+    int phrase_count;
+    int phrase_length[LICENSE_MAX_PHRASES];
+    // license_phrases[l][p] is set when phrase p belongs to corpus license l
+    unsigned char license_phrases[LICENSE_CORPUS_COUNT][LICENSE_MAX_PHRASES];
+} LicenseMatcher;
+
+static LicenseMatcher license_matcher;
+static pthread_once_t license_matcher_once = PTHREAD_ONCE_INIT;
+
+// Letters and digits map to 1..36, everything else to the space symbol 0
+int license_symbol(unsigned char c) {
+    if (c >= 'a' && c <= 'z') {
+        return c - 'a' + 1;
+    }
+    if (c >= 'A' && c <= 'Z') {
+        return c - 'A' + 1;
+    }
+    if (c >= '0' && c <= '9') {
+        return c - '0' + 27;
+    }
+    return 0;
+}
+
+int license_trie_step(LicenseMatcher *m, int state, int symbol) {
+    if (m->states[state].next[symbol] == 0) {
+        if (m->state_count == m->state_capacity) {
+            m->state_capacity *= 2;
+            m->states = realloc(m->states, m->state_capacity * sizeof(MatchState));
+        }
+        MatchState *added = &m->states[m->state_count];
+        memset(added, 0, sizeof(*added));
+        added->phrase = -1;
+        added->dict = -1;
+        m->states[state].next[symbol] = m->state_count++;
+    }
+    return m->states[state].next[symbol];
+}
+
+void license_matcher_build(void) {
+    LicenseMatcher *m = &license_matcher;
+    m->state_capacity = 4096;
+    m->states = calloc(m->state_capacity, sizeof(MatchState));
+    m->states[0].phrase = -1;
+    m->states[0].dict = -1;
+    m->state_count = 1;
+
+    // Build the trie, sharing phrases that several licenses contain
+    for (int l = 0; l < LICENSE_CORPUS_COUNT; l++) {
+        for (int i = 0; i < 5 && license_corpus[l].phrases[i]; i++) {
+            int state = 0;
+            int length = 0;
+            int pending_space = 0;
+            for (const char *p = license_corpus[l].phrases[i]; *p; p++) {
+                int symbol = license_symbol(*p);
+                if (symbol == 0) {
+                    pending_space = length > 0;
+                    continue;
+                }
+                if (pending_space) {
+                    state = license_trie_step(m, state, 0);
+                    length++;
+                    pending_space = 0;
+                }
+                state = license_trie_step(m, state, symbol);
+                length++;
+            }
+            if (m->states[state].phrase < 0 && m->phrase_count < LICENSE_MAX_PHRASES) {
+                m->phrase_length[m->phrase_count] = length;
+                m->states[state].phrase = m->phrase_count++;
+            }
+            if (m->states[state].phrase >= 0) {
+                m->license_phrases[l][m->states[state].phrase] = 1;
+            }
+        }
+    }
+
+    // Breadth-first: fill in failure links and turn the trie into a full automaton
+    int *queue = malloc(m->state_count * sizeof(int));
+    int head = 0;
+    int tail = 0;
+    for (int symbol = 0; symbol < LICENSE_SYMBOLS; symbol++) {
+        if (m->states[0].next[symbol]) {
+            queue[tail++] = m->states[0].next[symbol];
+        }
+    }
+    while (head < tail) {
+        int state = queue[head++];
+        int fail = m->states[state].fail;
+        m->states[state].dict = m->states[fail].phrase >= 0 ? fail : m->states[fail].dict;
+        for (int symbol = 0; symbol < LICENSE_SYMBOLS; symbol++) {
+            int child = m->states[state].next[symbol];
+            if (child) {
+                m->states[child].fail = state ? m->states[fail].next[symbol] : 0;
+                queue[tail++] = child;
+            } else {
+                m->states[state].next[symbol] = m->states[fail].next[symbol];
+            }
+        }
+    }
+    free(queue);
+}
+
+// Mark which corpus phrases occur in `text`
+void license_match(const char *text, size_t size, unsigned char *found) {
+    pthread_once(&license_matcher_once, license_matcher_build);
+    const MatchState *states = license_matcher.states;
+    int state = 0;
+    int pending_space = 0;
+    for (size_t i = 0; i < size; i++) {
+        int symbol = license_symbol(text[i]);
+        if (symbol == 0) {
+            pending_space = 1;
+            continue;
+        }
+        if (pending_space) {
+            state = states[state].next[0];
+            pending_space = 0;
+        }
+        state = states[state].next[symbol];
+        int output = states[state].phrase >= 0 ? state : states[state].dict;
+        for (; output >= 0; output = states[output].dict) {
+            found[states[output].phrase] = 1;
+        }
+    }
+}
+
+// Whether every phrase of license `a` is also in license `b`
+int license_is_subset(int a, int b) {
+    for (int p = 0; p < license_matcher.phrase_count; p++) {
+        if (license_matcher.license_phrases[a][p] && !license_matcher.license_phrases[b][p]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Score each corpus license by the share of its phrase text found in a file
+void license_score(const unsigned char *found, double *scores) {
+    for (int l = 0; l < LICENSE_CORPUS_COUNT; l++) {
+        int total = 0;
+        int matched = 0;
+        for (int p = 0; p < license_matcher.phrase_count; p++) {
+            if (license_matcher.license_phrases[l][p]) {
+                total += license_matcher.phrase_length[p];
+                matched += found[p] ? license_matcher.phrase_length[p] : 0;
+            }
+        }
+        scores[l] = total ? (double)matched / total : 0;
+    }
+
+    // A text that contains a smaller license (BSD-2-Clause in BSD-3-Clause)
+    // counts as the larger one only if that matched completely
+    for (int a = 0; a < LICENSE_CORPUS_COUNT; a++) {
+        for (int b = 0; b < LICENSE_CORPUS_COUNT; b++) {
+            if (a == b || scores[a] < LICENSE_MIN_CONFIDENCE || scores[b] < LICENSE_MIN_CONFIDENCE ||
+                !license_is_subset(a, b)) {
+                continue;
+            }
+            if (scores[b] == 1.0) {
+                scores[a] = 0;
+            } else if (scores[a] == 1.0) {
+                scores[b] = 0;
+            }
+        }
+    }
+}
+
+typedef struct {
+    char id[64];
+    int scope;
+    double confidence;
+    int license_files;
+    int header_files;
+    char evidence[256];
+} LicenseCandidate;
+
+typedef struct {
+    LicenseCandidate *candidates;
+    int count;
+    int capacity;
+    int files_scanned;
+    int header_files;
+    const char *root;
+    char packages[MAX_PACKAGES][256];
+    int package_count;
+    PathList paths;
+    pthread_mutex_t lock;
+} LicenseScan;
+
+// Split packages scope licenses by directory; a single package takes everything
+void license_scan_init(LicenseScan *scan, StarbuildConfig *config) {
+    memset(scan, 0, sizeof(*scan));
+    pthread_mutex_init(&scan->lock, NULL);
+    if (config && config->package_count > 1) {
+        for (int i = 0; i < config->package_count; i++) {
+            snprintf(scan->packages[i], sizeof(scan->packages[i]), "%s", config->packages[i].name);
+        }
+        scan->package_count = config->package_count;
+    }
+}
+
+void license_scan_free(LicenseScan *scan) {
+    free(scan->candidates);
+    path_list_free(&scan->paths);
+    pthread_mutex_destroy(&scan->lock);
+}
+
+// Files under a directory named after a package, or after its suffix
+// beyond the first package's name ("docs" for foo-docs), belong to it
+int license_scope(LicenseScan *scan, const char *path) {
+    size_t base_len = scan->package_count ? strlen(scan->packages[0]) : 0;
+    const char *slash;
+    for (const char *p = path; (slash = strchr(p, '/')) != NULL; p = slash + 1) {
+        size_t len = slash - p;
+        for (int i = 0; i < scan->package_count; i++) {
+            const char *name = scan->packages[i];
+            if (strlen(name) == len && strncmp(p, name, len) == 0) {
+                return i;
+            }
+            if (i > 0 && strncmp(name, scan->packages[0], base_len) == 0 && name[base_len] == '-' &&
+                strlen(name + base_len + 1) == len && strncmp(p, name + base_len + 1, len) == 0) {
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
+void license_note(LicenseScan *scan, int scope, const char *id, double confidence, int from_header, const char *evidence) {
+    pthread_mutex_lock(&scan->lock);
+    LicenseCandidate *candidate = NULL;
+    for (int i = 0; i < scan->count; i++) {
+        if (scan->candidates[i].scope == scope && strcmp(scan->candidates[i].id, id) == 0) {
+            candidate = &scan->candidates[i];
+            break;
+        }
+    }
+    if (!candidate) {
+        if (scan->count == scan->capacity) {
+            scan->capacity = scan->capacity ? scan->capacity * 2 : 16;
+            scan->candidates = realloc(scan->candidates, scan->capacity * sizeof(LicenseCandidate));
+        }
+        candidate = &scan->candidates[scan->count++];
+        memset(candidate, 0, sizeof(*candidate));
+        snprintf(candidate->id, sizeof(candidate->id), "%s", id);
+        candidate->scope = scope;
+    }
+    if (confidence > candidate->confidence) {
+        candidate->confidence = confidence;
+    }
+    if (from_header) {
+        candidate->header_files++;
+    } else {
+        if (candidate->license_files++ == 0) {
+            snprintf(candidate->evidence, sizeof(candidate->evidence), "%s", evidence);
+        }
+    }
+    pthread_mutex_unlock(&scan->lock);
+}
+
+// Record the ids of an SPDX-License-Identifier expression
+void license_note_spdx(LicenseScan *scan, int scope, const char *tag, const char *end) {
+    char expression[256];
+    const char *eol = memchr(tag, '\n', end - tag);
+    snprintf(expression, sizeof(expression), "%.*s", (int)((eol ? eol : end) - tag), tag);
+
+    int skip_next = 0;
+    int noted = 0;
+    char *saveptr;
+    for (char *token = strtok_r(expression, " \t\r()", &saveptr); token; token = strtok_r(NULL, " \t\r()", &saveptr)) {
+        // Drop comment closers and quotes around the tag
+        char *last = token + strlen(token);
+        while (last > token && !isalnum((unsigned char)last[-1]) && last[-1] != '+') {
+            *--last = '\0';
+        }
+        if (skip_next) {
+            skip_next = 0;
+            continue;
+        }
+        if (strcmp(token, "WITH") == 0) {
+            skip_next = 1;
+            continue;
+        }
+        if (!isalpha((unsigned char)token[0]) || strcmp(token, "AND") == 0 || strcmp(token, "OR") == 0) {
+            continue;
+        }
+        license_note(scan, scope, token, 1.0, 1, NULL);
+        noted = 1;
+    }
+    if (noted) {
+        pthread_mutex_lock(&scan->lock);
+        scan->header_files++;
+        pthread_mutex_unlock(&scan->lock);
+    }
+}
+
+// LICENSE*, COPYING* and REUSE-style LICENSES/<id>.txt files
+int is_license_path(const char *path) {
+    const char *filename = strrchr(path, '/');
+    filename = filename ? filename + 1 : path;
+    if (is_license_file(filename)) {
+        return 1;
+    }
+    return filename - path >= 9 && strncmp(filename - 9, "LICENSES/", 9) == 0;
+}
+
+void license_scan_text(LicenseScan *scan, const char *path, const char *text, size_t size, int is_license) {
+    int scope = scan->package_count ? license_scope(scan, path) : -1;
+    if (!is_license) {
+        const char *tag = memmem(text, size, "SPDX-License-Identifier:", 24);
+        if (tag) {
+            license_note_spdx(scan, scope, tag + 24, text + size);
+        }
+        return;
+    }
+
+    unsigned char found[LICENSE_MAX_PHRASES] = {0};
+    double scores[LICENSE_CORPUS_COUNT];
+    license_match(text, size, found);
+    license_score(found, scores);
+    for (int l = 0; l < LICENSE_CORPUS_COUNT; l++) {
+        if (scores[l] >= LICENSE_MIN_CONFIDENCE) {
+            license_note(scan, scope, license_corpus[l].id, scores[l], 0, path);
+        }
+    }
+}
+
+void license_scan_work(void *context, int index) {
+    LicenseScan *scan = context;
+    const char *path = scan->paths.paths[index];
+    const char *relative = path + strlen(scan->root);
+    while (*relative == '/') {
+        relative++;
+    }
+    int is_license = is_license_path(relative);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    char head[LICENSE_HEAD_BYTES];
+    char *buffer = is_license ? malloc(TAR_MAX_MEMBER) : head;
+    size_t size = read_full(fd, buffer, is_license ? TAR_MAX_MEMBER : LICENSE_HEAD_BYTES);
+    close(fd);
+    license_scan_text(scan, relative, buffer, size, is_license);
+    if (buffer != head) {
+        free(buffer);
+    }
+}
+
+void license_scan_dir(LicenseScan *scan, const char *dir, int threads) {
+    TRACE_SCOPE("license_scan_dir");
+    scan->root = dir;
+    collect_files(dir, NULL, &scan->paths);
+    parallel_for(scan->paths.count, threads, license_scan_work, scan);
+    scan->files_scanned += scan->paths.count;
+    path_list_free(&scan->paths);
+}
+
+int license_tar_want(void *context, const char *member, uint64_t size) {
+    LicenseScan *scan = context;
+    (void)size;
+    if (member[strlen(member) - 1] == '/') {
+        return 0;
+    }
+    scan->files_scanned++;
+    return is_license_path(member) ? TAR_MAX_MEMBER : LICENSE_HEAD_BYTES;
+}
+
+int license_tar_data(void *context, const char *member, const char *data, size_t size) {
+    license_scan_text(context, member, data, size, is_license_path(member));
+    return 0;
+}
+
+// A tarball is one sequential stream, so its files are matched as they arrive
+int license_scan_tarball(LicenseScan *scan, const char *archive) {
+    TRACE_SCOPE("license_scan_tarball");
+    return tar_read(archive, license_tar_want, license_tar_data, scan);
+}
+
+int dir_has_license_file(const char *dir) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        return 0;
+    }
+    struct dirent *entry;
+    int found = 0;
+    while (!found && (entry = readdir(d)) != NULL) {
+        found = is_license_file(entry->d_name);
+    }
+    closedir(d);
+    return found;
+}
+
+// Scan the local tarballs and directories among the sources, or the current
+// directory if it looks like a source tree. Returns how many were scanned.
+int license_scan_sources(LicenseScan *scan, StarbuildConfig *config, int threads) {
+    int scanned = 0;
+    for (int i = 0; i < config->sources_count; i++) {
+        char path[512];
+        struct stat st;
+        if (source_archive_path(config->sources[i], path, sizeof(path))) {
+            if (license_scan_tarball(scan, path) < 0) {
+                print_warning("Could not read the whole archive");
+            }
+            scanned++;
+        } else if (!strstr(config->sources[i], "://") && stat(config->sources[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+            license_scan_dir(scan, config->sources[i], threads);
+            scanned++;
+        }
+    }
+    if (scanned == 0 && dir_has_license_file(".")) {
+        license_scan_dir(scan, ".", threads);
+        scanned++;
+    }
+    return scanned;
+}
+
+int compare_license_candidates(const void *a, const void *b) {
+    const LicenseCandidate *x = a;
+    const LicenseCandidate *y = b;
+    if (x->scope != y->scope) {
+        return x->scope - y->scope;
+    }
+    if (x->confidence != y->confidence) {
+        return x->confidence < y->confidence ? 1 : -1;
+    }
+    if (x->header_files != y->header_files) {
+        return y->header_files - x->header_files;
+    }
+    return strcmp(x->id, y->id);
+}
+
+// Header tags that only a few files carry are usually vendored code
+int license_is_proposed(LicenseScan *scan, LicenseCandidate *candidate) {
+    return candidate->license_files > 0 || candidate->header_files * 20 >= scan->header_files;
+}
+
+// "GPL-2.0-or-later" and "GPL-2.0-only" are the same license text
+int license_same_family(const char *a, const char *b) {
+    size_t a_len = strlen(a);
+    size_t b_len = strlen(b);
+    const char *suffixes[] = {"-only", "-or-later", "+"};
+    for (int i = 0; i < 3; i++) {
+        size_t len = strlen(suffixes[i]);
+        if (a_len > len && strcmp(a + a_len - len, suffixes[i]) == 0) {
+            a_len -= len;
+        }
+        if (b_len > len && strcmp(b + b_len - len, suffixes[i]) == 0) {
+            b_len -= len;
+        }
+    }
+    return a_len == b_len && strncmp(a, b, a_len) == 0;
+}
+
+// Comma-separated proposal for one scope (a package index, or -1 for files
+// outside every package directory); returns the number of licenses
+int license_proposal(LicenseScan *scan, int scope, char *out, size_t size) {
+    int count = 0;
+    out[0] = '\0';
+    qsort(scan->candidates, scan->count, sizeof(LicenseCandidate), compare_license_candidates);
+    for (int i = 0; i < scan->count; i++) {
+        LicenseCandidate *candidate = &scan->candidates[i];
+        if (candidate->scope != scope || !license_is_proposed(scan, candidate)) {
+            continue;
+        }
+        // An SPDX tag says more than the text (-only vs -or-later), so it wins
+        int duplicate = 0;
+        for (int j = 0; j < scan->count && !duplicate; j++) {
+            LicenseCandidate *other = &scan->candidates[j];
+            duplicate = j != i && other->scope == scope && license_is_proposed(scan, other) &&
+                        license_same_family(candidate->id, other->id) &&
+                        (other->header_files > candidate->header_files ||
+                         (other->header_files == candidate->header_files && j < i));
+        }
+        if (duplicate || strlen(out) + strlen(candidate->id) + 3 > size) {
+            continue;
+        }
+        if (count++ > 0) {
+            strcat(out, ", ");
+        }
+        strcat(out, candidate->id);
+    }
+    return count;
+}
+
+void print_license_candidates(LicenseScan *scan) {
+    qsort(scan->candidates, scan->count, sizeof(LicenseCandidate), compare_license_candidates);
+    printf("Detected licenses (%d file(s) scanned):\n", scan->files_scanned);
+    for (int i = 0; i < scan->count; i++) {
+        LicenseCandidate *candidate = &scan->candidates[i];
+        if (i == 0 || candidate->scope != scan->candidates[i - 1].scope) {
+            if (scan->package_count) {
+                printf("  %s:\n", candidate->scope >= 0 ? scan->packages[candidate->scope] : "(shared)");
+            }
+        }
+        printf("    %-20s %3.0f%%  ", candidate->id, candidate->confidence * 100);
+        if (candidate->license_files > 0) {
+            printf("%s", candidate->evidence);
+            if (candidate->license_files > 1) {
+                printf(" and %d more", candidate->license_files - 1);
+            }
+            printf("%s", candidate->header_files ? ", " : "");
+        }
+        if (candidate->header_files > 0) {
+            printf("SPDX tag in %d file(s)", candidate->header_files);
+        }
+        printf("%s\n", license_is_proposed(scan, candidate) ? "" : " (ignored)");
+    }
+}
+
+// Proposal for package `index`, falling back to the shared files
+int license_package_proposal(LicenseScan *scan, int index, char *out, size_t size) {
+    if (scan->package_count && license_proposal(scan, index, out, size) > 0) {
+        return 1;
+    }
+    return license_proposal(scan, -1, out, size) > 0;
+}
+
+int licenses_mode(int argc, char *argv[]) {
+    int threads = default_thread_count();
+    int first = 0;
+    if (argc >= 2 && strcmp(argv[0], "-j") == 0) {
+        threads = atoi(argv[1]) > 0 ? atoi(argv[1]) : 1;
+        first = 2;
+    }
+
+    char *current_dir[] = {"."};
+    char **paths = argc > first ? argv + first : current_dir;
+    int path_count = argc > first ? argc - first : 1;
+
+    LicenseScan scan;
+    license_scan_init(&scan, NULL);
+    int failed = 0;
+    for (int i = 0; i < path_count; i++) {
+        const char *path = paths[i];
+        struct stat st;
+        if (tar_decompressor(path) && stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+            if (license_scan_tarball(&scan, path) < 0) {
+                fprintf(stderr, "%s: could not read the whole archive\n", path);
+                failed = 1;
+            }
+        } else if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+            license_scan_dir(&scan, path, threads);
+        } else {
+            fprintf(stderr, "%s: not a directory or tarball\n", path);
+            failed = 1;
+        }
+    }
+
+    print_license_candidates(&scan);
+    char proposal[MAX_LINE];
+    if (license_proposal(&scan, -1, proposal, sizeof(proposal)) > 0) {
+        printf("\nProposed license(s): %s\n", proposal);
+    }
+    license_scan_free(&scan);
+    return failed;
+}
+
+// Interactive wizard functions
+void wizard_advanced_fields(StarbuildConfig *config) {
+    TRACE_SCOPE("wizard_advanced_fields");
+    print_header("Advanced Fields");
+    printf("Would you like to configure advanced package fields?\n");
+    printf("These include:\n");
+    printf("  - gives: Virtual packages this package provides\n");
+    printf("  - clashes: Packages that conflict with this one\n");
+    printf("  - optional_dependencies: Optional dependencies\n");
+    // Templates that set advanced fields keep them enabled
+    config->enable_advanced_fields = get_yes_no("Enable advanced fields") || config->enable_advanced_fields;
+}
+
+void wizard_basic_info(StarbuildConfig *config) {
+    TRACE_SCOPE("wizard_basic_info");
+    print_header("Basic Package Information");
+    
+    char package_names[MAX_LINE];
+    char suggested_name[256];
+    suggest_package_name(suggested_name);
+    
+    // Prefer the package names from a template over the directory name
+    if (config->package_count > 0) {
+        suggested_name[0] = '\0';
+        for (int i = 0; i < config->package_count; i++) {
+            if (strlen(suggested_name) + strlen(config->packages[i].name) + 2 < sizeof(suggested_name)) {
+                strcat(suggested_name, i ? "," : "");
+                strcat(suggested_name, config->packages[i].name);
+            }
+        }
+    }
+    
+    char prompt[512];
+    snprintf(prompt, sizeof(prompt), "Package name(s) (comma-separated for multiple) [%s]", suggested_name);
+    get_input(prompt, package_names, sizeof(package_names));
+    
+    // If no input provided, use suggested name
+    if (strlen(package_names) == 0) {
+        strcpy(package_names, suggested_name);
+    }
+    
+    // Parse package names
+    apply_template_value(config, "package_name", package_names);
+    
+    if (config->package_count == 0) {
+        print_error("No valid package names provided");
+        // Set a default package name
+        strcpy(config->packages[0].name, "mypackage");
+        config->package_count = 1;
+        print_warning("Using default package name 'mypackage'");
+    }
+    
+    // Get version and description
+    get_input_default("Package version", config->packages[0].version, sizeof(config->packages[0].version));
+    
+    // For multiple packages, get individual descriptions
+    if (config->package_count == 1) {
+        get_input_default("Package description", config->packages[0].description, sizeof(config->packages[0].description));
+    } else {
+        printf("\nEnter descriptions for each package:\n");
+        for (int i = 0; i < config->package_count; i++) {
+            char prompt[256];
+            snprintf(prompt, sizeof(prompt), "Description for %s", config->packages[i].name);
+            get_input_default(prompt, config->packages[i].description, sizeof(config->packages[i].description));
+        }
+    }
+    
+    // Propose licenses found in the sources; Enter accepts the proposal
+    LicenseScan scan;
+    license_scan_init(&scan, config);
+    if (license_scan_sources(&scan, config, default_thread_count()) > 0 && scan.count > 0) {
+        printf("\n");
+        print_license_candidates(&scan);
+    }
+    
+    // Get license information
+    if (config->package_count == 1) {
+        char license_input[MAX_LINE] = "";
+        if (config->packages[0].license_count == 0) {
+            license_package_proposal(&scan, 0, license_input, sizeof(license_input));
+        }
+        get_input_default("License(s) (comma-separated, e.g., 'GPL-3.0, MIT')", license_input, sizeof(license_input));
+        
+        // Parse comma-separated licenses
+        add_list_values(config->packages[0].license, &config->packages[0].license_count, MAX_DEPS, license_input);
+    } else {
+        printf("\nEnter licenses for each package:\n");
+        for (int i = 0; i < config->package_count; i++) {
+            char license_input[MAX_LINE] = "";
+            char prompt[256];
+            snprintf(prompt, sizeof(prompt), "License(s) for %s (comma-separated)", config->packages[i].name);
+            if (config->packages[i].license_count == 0) {
+                license_package_proposal(&scan, i, license_input, sizeof(license_input));
+            }
+            get_input_default(prompt, license_input, sizeof(license_input));
+            
+            // Parse comma-separated licenses
+            add_list_values(config->packages[i].license, &config->packages[i].license_count, MAX_DEPS, license_input);
+        }
+    }
+    license_scan_free(&scan);
+}
+
+void wizard_dependencies(StarbuildConfig *config) {
+    TRACE_SCOPE("wizard_dependencies");
+    print_header("Dependencies");
+    
+    char deps_input[MAX_LINE];
+    get_input("Global dependencies (comma-separated)", deps_input, sizeof(deps_input));
+    
+    // Parse comma-separated dependencies
+    add_list_values(config->global_deps, &config->global_deps_count, MAX_DEPS, deps_input);
+    
+    char build_deps_input[MAX_LINE];
+    get_input("Build dependencies (comma-separated)", build_deps_input, sizeof(build_deps_input));
+    
+    add_list_values(config->build_deps, &config->build_deps_count, MAX_DEPS, build_deps_input);
+    
+    // For multiple packages, get package-specific dependencies
+    if (config->package_count > 1) {
+        printf("\nPackage-specific dependencies:\n");
+        for (int i = 0; i < config->package_count; i++) {
+            char pkg_deps[MAX_LINE];
+            char prompt[256];
+            snprintf(prompt, sizeof(prompt), "Additional dependencies for %s (comma-separated)", config->packages[i].name);
+            get_input(prompt, pkg_deps, sizeof(pkg_deps));
+            
+            add_list_values(config->packages[i].deps, &config->packages[i].deps_count, MAX_DEPS, pkg_deps);
+        }
+    }
+}
+
+// Look inside local tarballs from `first` on to prefill what is still empty
+void wizard_inspect_sources(StarbuildConfig *config, int first) {
+    for (int i = first; i < config->sources_count; i++) {
+        char path[512];
+        if (!source_archive_path(config->sources[i], path, sizeof(path))) {
+            continue;
+        }
+        SourceInfo info;
+        printf("Inspecting %s...\n", path);
+        if (inspect_source(path, &info) < 0) {
+            print_warning("Could not read the whole archive");
+        }
+        print_source_info(&info);
+        apply_source_info(&info, config);
+    }
+}
+
+void wizard_sources(StarbuildConfig *config) {
+    TRACE_SCOPE("wizard_sources");
+    print_header("Sources");
+    
+    char sources_input[MAX_LINE];
+    get_input("Source URLs (comma-separated)", sources_input, sizeof(sources_input));
+    
+    // Tarballs given with -s were inspected before the first prompt
+    int first = config->sources_count;
+    add_source_values(config->sources, &config->sources_count, MAX_SOURCES, sources_input);
+    wizard_inspect_sources(config, first);
+}
+
+void wizard_advanced_package_fields(StarbuildConfig *config) {
+    TRACE_SCOPE("wizard_advanced_package_fields");
+    if (!config->enable_advanced_fields) {
+        return;
+    }
+    
+    print_header("Advanced Package Fields");
+    
+    if (config->package_count == 1) {
+        // Single package - get advanced fields
+        char gives_input[MAX_LINE];
+        get_input("Gives (virtual packages, comma-separated)", gives_input, sizeof(gives_input));
+        
+        add_list_values(config->packages[0].gives, &config->packages[0].gives_count, MAX_DEPS, gives_input);
+        
+        char clashes_input[MAX_LINE];
+        get_input("Clashes (conflicting packages, comma-separated)", clashes_input, sizeof(clashes_input));
+        
+        add_list_values(config->packages[0].clashes, &config->packages[0].clashes_count, MAX_DEPS, clashes_input);
+        
+        char optional_deps_input[MAX_LINE];
+        get_input("Optional dependencies (comma-separated)", optional_deps_input, sizeof(optional_deps_input));
+        
+        add_list_values(config->packages[0].optional_dependencies, &config->packages[0].optional_dependencies_count, MAX_DEPS, optional_deps_input);
+    } else {
+        // Multiple packages - get advanced fields for each
+        printf("\nAdvanced fields for each package:\n");
+        for (int i = 0; i < config->package_count; i++) {
+            printf("\nPackage: %s\n", config->packages[i].name);
+            
+            char gives_input[MAX_LINE];
+            char prompt[256];
+            snprintf(prompt, sizeof(prompt), "Gives for %s (comma-separated)", config->packages[i].name);
+            get_input(prompt, gives_input, sizeof(gives_input));
+            
+            add_list_values(config->packages[i].gives, &config->packages[i].gives_count, MAX_DEPS, gives_input);
+            
+            char clashes_input[MAX_LINE];
+            snprintf(prompt, sizeof(prompt), "Clashes for %s (comma-separated)", config->packages[i].name);
+            get_input(prompt, clashes_input, sizeof(clashes_input));
+            
+            add_list_values(config->packages[i].clashes, &config->packages[i].clashes_count, MAX_DEPS, clashes_input);
+            
+            char optional_deps_input[MAX_LINE];
+            snprintf(prompt, sizeof(prompt), "Optional dependencies for %s (comma-separated)", config->packages[i].name);
+            get_input(prompt, optional_deps_input, sizeof(optional_deps_input));
+            
+            add_list_values(config->packages[i].optional_dependencies, &config->packages[i].optional_dependencies_count, MAX_DEPS, optional_deps_input);
+        }
+    }
+}
+
+void wizard_scripts(StarbuildConfig *config) {
+    TRACE_SCOPE("wizard_scripts");
+    print_header("Build Scripts");
+    
+    printf("Enter the build scripts (multi-line, press Enter twice to finish each script):\n\n");
+    
+    // Get prepare script
+    get_script_input("Prepare script (e.g., 'cd \"${srcdir}\"')", config->prepare_script, &config->prepare_script_lines);
+    
+    // Get compile script
+    get_script_input("Compile script (e.g., 'make -j$(nproc)')", config->compile_script, &config->compile_script_lines);
+    
+    // Get verify script
+    get_script_input("Verify script (e.g., 'make check')", config->verify_script, &config->verify_script_lines);
+    
+    // Get assemble script(s)
+    if (config->package_count == 1) {
+        printf("\nAssemble script for %s:\n", config->packages[0].name);
+        get_script_input("Assemble script (e.g., 'make DESTDIR=\"${pkgdir}\" install')", config->assemble_scripts[0], &config->assemble_script_lines[0]);
+    } else {
+        printf("\nAssemble scripts for each package:\n");
+        for (int i = 0; i < config->package_count; i++) {
+            char prompt[256];
+            snprintf(prompt, sizeof(prompt), "Assemble script for %s", config->packages[i].name);
+            get_script_input(prompt, config->assemble_scripts[i], &config->assemble_script_lines[i]);
+        }
+    }
+}
+
+void wizard_options(StarbuildConfig *config) {
+    TRACE_SCOPE("wizard_options");
+    print_header("Package Options");
+    printf("Select package options using arrow keys and Enter to toggle:\n");
+    printf("Use arrow keys to navigate, Enter to toggle, 'q' to finish\n\n");
+    
+    // Enable raw mode for better input handling
+    enable_raw_mode();
+    
+    // Define available options
+    const char *available_options[] = {
+        "no-strip",
+        "no-strip-binaries", 
+        "no-remove-la",
+        "no-remove-a",
+        "man",
+        "libs",
+        "include",
+        "docs",
+        "lto"
+    };
+    int num_options = sizeof(available_options) / sizeof(available_options[0]);
+    
+    // Initialize option states (0 = disabled, 1 = enabled, 2 = negated)
+    int option_states[MAX_OPTIONS] = {0};
+    int selected_option = 0;
+    
+    // Start from any options a template already set
+    char extra_options[MAX_OPTIONS][256];
+    int extra_count = 0;
+    for (int j = 0; j < config->options_count; j++) {
+        const char *name = config->options[j][0] == '!' ? config->options[j] + 1 : config->options[j];
+        int known = 0;
+        for (int i = 0; i < num_options; i++) {
+            if (strcmp(name, available_options[i]) == 0) {
+                option_states[i] = config->options[j][0] == '!' ? 2 : 1;
+                known = 1;
+            }
+        }
+        if (!known) {
+            strcpy(extra_options[extra_count++], config->options[j]);
+        }
+    }
+    
+    while (1) {
+        // Clear screen and redraw
+        clear_screen();
+        print_header("Package Options");
+        printf("Select package options using arrow keys and Enter to toggle:\n");
+        printf("Use arrow keys to navigate, Enter to toggle, 'q' to finish\n\n");
+        
+        for (int i = 0; i < num_options; i++) {
+            if (i == selected_option) {
+                printf("  > ");
+            } else {
+                printf("    ");
+            }
+            
+            if (option_states[i] == 0) {
+                // Disabled - not shown
+                printf("  %s\n", available_options[i]);
+            } else if (option_states[i] == 1) {
+                // Enabled - white highlight
+                print_highlighted(available_options[i]);
+                printf("\n");
+            } else if (option_states[i] == 2) {
+                // Negated - red highlight
+                print_disabled("!");
+                print_disabled(available_options[i]);
+                printf("\n");
+            }
+        }
+        
+        printf("\nLegend: ");
+        print_highlighted("purple = enabled");
+        printf(", ");
+        print_disabled("red = disabled");
+        printf(", normal = not selected\n");
+        
+        // Get user input
+        int ch = getchar();
+        
+        // Handle arrow keys and other input
+        if (ch == 'q' || ch == 'Q' || ch == EOF) {
+            break;
+        } else if (ch == 27) { // ESC sequence
+            ch = getchar();
+            if (ch == '[') {
+                ch = getchar();
+                if (ch == 'A') { // Up arrow
+                    selected_option = (selected_option - 1 + num_options) % num_options;
+                } else if (ch == 'B') { // Down arrow
+                    selected_option = (selected_option + 1) % num_options;
+                }
+            }
+        } else if (ch == '\n' || ch == ' ') { // Enter or space
+            // Toggle option state: 0 -> 1 -> 2 -> 0
+            option_states[selected_option] = (option_states[selected_option] + 1) % 3;
+        }
+    }
+    
+    // Disable raw mode
+    disable_raw_mode();
+    
+    // Convert selected options to config
+    config->options_count = 0;
+    for (int i = 0; i < num_options; i++) {
+        if (option_states[i] == 1) {
+            // Enabled option
+            strcpy(config->options[config->options_count], available_options[i]);
+            config->options_count++;
+        } else if (option_states[i] == 2) {
+            // Negated option
+            snprintf(config->options[config->options_count], sizeof(config->options[config->options_count]), "!%s", available_options[i]);
+            config->options_count++;
+        }
+    }
+    for (int i = 0; i < extra_count && config->options_count < MAX_OPTIONS; i++) {
+        strcpy(config->options[config->options_count++], extra_options[i]);
+    }
+}
+
+// Build key
+//
+// The build key is a hash over a canonical rendering of the fields that
+// change what gets built: version, dependencies, options, sources, scripts
+// and package names. Set-like lists are sorted and deduplicated, packages
+// are ordered by name, and script whitespace and comments are normalised
+// away. Descriptive metadata (description, license, provides, conflicts,
+// optional dependencies) is left out, as are file contents, so the key
+// depends only on the recipe. With --hash-sources, local source files also
+// contribute a hash of their contents.
+#define BUILD_KEY_VERSION "starbuild-key-v2"
+
+static int build_key_hash_sources;
+
+int compare_strings(const void *a, const void *b) {
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+void canonical_value(StrBuf *out, const char *value) {
+    sb_printf(out, "%zu:", strlen(value));
+    sb_append(out, value, strlen(value));
+    sb_putc(out, ';');
+}
+
+// Emit the union of up to two lists, sorted and without duplicates
+void canonical_list(StrBuf *out, const char *key, char first[][256], int first_count, char second[][256], int second_count) {
+    const char *values[MAX_DEPS * 2];
+    int count = 0;
+    for (int i = 0; i < first_count && count < MAX_DEPS * 2; i++) {
+        values[count++] = first[i];
+    }
+    for (int i = 0; i < second_count && count < MAX_DEPS * 2; i++) {
+        values[count++] = second[i];
+    }
+    qsort(values, count, sizeof(values[0]), compare_strings);
+
+    sb_printf(out, "%s=", key);
+    for (int i = 0; i < count; i++) {
+        if (i == 0 || strcmp(values[i], values[i - 1]) != 0) {
+            canonical_value(out, values[i]);
+        }
+    }
+    sb_putc(out, '\n');
+}
+
+// Collapse unquoted whitespace runs; drop blank lines and comments
+void canonical_script_line(StrBuf *out, const char *line, size_t len) {
+    const char *p = line;
+    const char *end = line + len;
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+    if (p == end || *p == '#') {
+        return;
+    }
+
+    char quote = 0;
+    int pending_space = 0;
+    for (; p < end; p++) {
+        if (!quote && (*p == ' ' || *p == '\t')) {
+            pending_space = 1;
+            continue;
+        }
+        if (!quote && *p == '#' && pending_space) {
+            break;
+        }
+        if (pending_space) {
+            sb_putc(out, ' ');
+            pending_space = 0;
+        }
+        if (quote && *p == '\\' && quote == '"' && p + 1 < end) {
+            sb_putc(out, *p++);
+        } else if (quote && *p == quote) {
+            quote = 0;
+        } else if (!quote && (*p == '"' || *p == '\'')) {
+            quote = *p;
+        } else if (!quote && *p == '\\' && p + 1 < end) {
+            sb_putc(out, *p++);
+        }
+        sb_putc(out, *p);
+    }
+    sb_putc(out, '\n');
+}
+
+void canonical_script(StrBuf *out, const char *key, char script[][MAX_LINE_LENGTH], int line_count) {
+    sb_printf(out, "%s{\n", key);
+    for (int i = 0; i < line_count; i++) {
+        canonical_script_line(out, script[i], strlen(script[i]));
+    }
+    sb_printf(out, "}\n");
+}
+
+// Hash a local source file's contents; remote sources are keyed by URL only.
+// Only used with --hash-sources.
+int hash_source_file(const char *base_dir, const char *source, uint64_t *hash) {
+    if (strstr(source, "://")) {
+        return -1;
+    }
+    char path[4096];
+    if (source[0] == '/' || !base_dir) {
+        snprintf(path, sizeof(path), "%s", source);
+    } else {
+        snprintf(path, sizeof(path), "%s/%s", base_dir, source);
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    uint64_t h = 0xcbf29ce484222325ULL;
+    char buffer[65536];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        h = fnv1a64(buffer, n, h);
+    }
+    close(fd);
+    if (n < 0) {
+        return -1;
+    }
+    *hash = h;
+    return 0;
+}
+
+int compare_packages_by_name(const void *a, const void *b) {
+    return strcmp((*(Package *const *)a)->name, (*(Package *const *)b)->name);
+}
+
+uint64_t compute_build_key(StarbuildConfig *config, const char *base_dir) {
+    TRACE_SCOPE("compute_build_key");
+    StrBuf out = {0};
+    sb_printf(&out, "%s\n", BUILD_KEY_VERSION);
+
+    sb_printf(&out, "version=");
+    canonical_value(&out, config->packages[0].version);
+    sb_putc(&out, '\n');
+    canonical_list(&out, "dependencies", config->global_deps, config->global_deps_count, NULL, 0);
+    canonical_list(&out, "build_dependencies", config->build_deps, config->build_deps_count, NULL, 0);
+    canonical_list(&out, "options", config->options, config->options_count, NULL, 0);
+
+    // Source order is meaningful, so sources are not sorted
+    sb_printf(&out, "sources=");
+    for (int i = 0; i < config->sources_count; i++) {
+        canonical_value(&out, config->sources[i]);
+        if (!build_key_hash_sources || strstr(config->sources[i], "://")) {
+            continue;
+        }
+        uint64_t hash;
+        if (hash_source_file(base_dir, config->sources[i], &hash) == 0) {
+            sb_printf(&out, "fnv1a64=%016llx;", (unsigned long long)hash);
+        } else {
+            // Keep a missing file distinguishable from one that was not hashed
+            sb_printf(&out, "missing;");
+        }
+    }
+    sb_putc(&out, '\n');
+
+    canonical_script(&out, "prepare", config->prepare_script, config->prepare_script_lines);
+    canonical_script(&out, "compile", config->compile_script, config->compile_script_lines);
+    canonical_script(&out, "verify", config->verify_script, config->verify_script_lines);
+
+    Package *packages[MAX_PACKAGES];
+    int package_count = config->package_count > 0 ? config->package_count : 1;
+    for (int i = 0; i < package_count; i++) {
+        packages[i] = &config->packages[i];
+    }
+    qsort(packages, package_count, sizeof(packages[0]), compare_packages_by_name);
+    for (int i = 0; i < package_count; i++) {
+        Package *p = packages[i];
+        int index = (int)(p - config->packages);
+        sb_printf(&out, "package=");
+        canonical_value(&out, p->name);
+        sb_putc(&out, '\n');
+        canonical_list(&out, "dependencies", p->deps, p->deps_count, NULL, 0);
+        canonical_script(&out, "assemble", config->assemble_scripts[index], config->assemble_script_lines[index]);
+    }
+
+    uint64_t key = fnv1a64(out.data, out.len, 0xcbf29ce484222325ULL);
+    free(out.data);
+    return key;
+}
+
+// File generation functions
+// Shell quoting
+//
+// Every value written into a STARBUILD goes through write_quoted() and
+// ends up in double quotes. A scan checks for ", $, ` and \; values with
+// none of them are written with a single fwrite. Otherwise ", ` and \ are
+// backslash-escaped, and so is every $ except a reference to a variable
+// the STARBUILD itself defines, such as ${package_version} in a source
+// URL. Those still expand when the file is sourced; anything else, like
+// $(...), stays literal.
+#define QUOTE_SPECIAL 1
+
+static const unsigned char quote_class_table[256] = {
+    ['"'] = QUOTE_SPECIAL, ['$'] = QUOTE_SPECIAL, ['`'] = QUOTE_SPECIAL, ['\\'] = QUOTE_SPECIAL,
+};
+
+static const char *quote_known_variables[] = {
+    "package_name", "package_version", "description", "srcdir", "pkgdir", "startdir",
+};
+
+int quote_scan_scalar(const char *str, size_t len) {
+    int flags = 0;
+    for (size_t i = 0; i < len; i++) {
+        flags |= quote_class_table[(unsigned char)str[i]];
+    }
+    return flags;
+}
+
+#if defined(__AVX2__)
+int quote_scan(const char *str, size_t len) {
+    const __m256i dquote = _mm256_set1_epi8('"');
+    const __m256i dollar = _mm256_set1_epi8('$');
+    const __m256i backtick = _mm256_set1_epi8('`');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(str + i));
+        __m256i special = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, dquote), _mm256_cmpeq_epi8(chunk, dollar)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, backtick), _mm256_cmpeq_epi8(chunk, backslash)));
+        if (_mm256_movemask_epi8(special)) {
+            return QUOTE_SPECIAL;
+        }
+    }
+    return quote_scan_scalar(str + i, len - i);
+}
+#elif defined(__SSE2__)
+int quote_scan(const char *str, size_t len) {
+    const __m128i dquote = _mm_set1_epi8('"');
+    const __m128i dollar = _mm_set1_epi8('$');
+    const __m128i backtick = _mm_set1_epi8('`');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(str + i));
+        __m128i special = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, dquote), _mm_cmpeq_epi8(chunk, dollar)),
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, backtick), _mm_cmpeq_epi8(chunk, backslash)));
+        if (_mm_movemask_epi8(special)) {
+            return QUOTE_SPECIAL;
+        }
+    }
+    return quote_scan_scalar(str + i, len - i);
+}
+#else
+int quote_scan(const char *str, size_t len) {
+    return quote_scan_scalar(str, len);
+}
+#endif
+
+// Length of a $name or ${name} reference to a STARBUILD variable at str, or 0
+size_t quote_known_reference(const char *str) {
+    const char *name = str + 1;
+    int braced = *name == '{';
+    name += braced;
+    size_t len = 0;
+    while (isalnum((unsigned char)name[len]) || name[len] == '_') {
+        len++;
+    }
+    if (len == 0 || (braced && name[len] != '}')) {
+        return 0;
+    }
+    for (size_t k = 0; k < sizeof(quote_known_variables) / sizeof(quote_known_variables[0]); k++) {
+        if (strlen(quote_known_variables[k]) == len && memcmp(name, quote_known_variables[k], len) == 0) {
+            return 1 + braced + len + braced;
+        }
+    }
+    return 0;
+}
+
+void write_quoted(FILE *fp, const char *str) {
+    size_t len = strlen(str);
+    fputc('"', fp);
+    if (!quote_scan(str, len)) {
+        fwrite(str, 1, len, fp);
+        fputc('"', fp);
+        return;
+    }
+
+    size_t start = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (!(quote_class_table[(unsigned char)str[i]] & QUOTE_SPECIAL)) {
+            continue;
+        }
+        size_t reference = str[i] == '$' ? quote_known_reference(str + i) : 0;
+        if (reference) {
+            i += reference - 1;
+            continue;
+        }
+        fwrite(str + start, 1, i - start, fp);
+        fputc('\\', fp);
+        start = i;
+    }
+    fwrite(str + start, 1, len - start, fp);
+    fputc('"', fp);
+}
+
+void write_assignment(FILE *fp, const char *name, const char *value) {
+    fprintf(fp, "%s=", name);
+    write_quoted(fp, value);
+    fputc('\n', fp);
+}
+
+void write_array(FILE *fp, const char *name, char array[][256], int count) {
+    if (count == 0) {
+        fprintf(fp, "%s=( )\n", name);
+        return;
+    }
+    
+    fprintf(fp, "%s=( ", name);
+    for (int i = 0; i < count; i++) {
+        write_quoted(fp, array[i]);
+        fputc(' ', fp);
+    }
+    fprintf(fp, ")\n");
+}
+
+void write_sources_array(FILE *fp, const char *name, char array[][512], int count) {
+    if (count == 0) {
+        fprintf(fp, "%s=( )\n", name);
+        return;
+    }
+    
+    fprintf(fp, "%s=( ", name);
+    for (int i = 0; i < count; i++) {
+        write_quoted(fp, array[i]);
+        fputc(' ', fp);
+    }
+    fprintf(fp, ")\n");
+}
+
+void write_script(FILE *fp, const char *name, const char *script) {
+    fprintf(fp, "%s() {\n%s}\n\n", name, script);
+}
+
+void write_multiline_script(FILE *fp, const char *name, char script[][MAX_LINE_LENGTH], int line_count) {
+    int has_command = 0;
+    fprintf(fp, "%s() {\n", name);
+    for (int i = 0; i < line_count; i++) {
+        if (strlen(script[i]) > 0) {
+            fprintf(fp, "    %s\n", script[i]);
+            has_command = has_command || script[i][0] != '#';
+        }
+    }
+    // bash rejects a function body with no commands in it
+    if (!has_command) {
+        fprintf(fp, "    :\n");
+    }
+    fprintf(fp, "}\n\n");
+}
+
+// gives/clashes may also carry the PKGBUILD-style provides/conflicts lists
+void write_merged_array(FILE *fp, const char *name, char first[][256], int first_count, char second[][256], int second_count) {
+    char merged[MAX_DEPS * 2][256];
+    int count = 0;
+    for (int i = 0; i < first_count; i++) {
+        add_list_value(merged, &count, MAX_DEPS * 2, first[i]);
+    }
+    for (int i = 0; i < second_count; i++) {
+        add_list_value(merged, &count, MAX_DEPS * 2, second[i]);
+    }
+    write_array(fp, name, merged, count);
+}
+
+int write_starbuild(const char *filename, StarbuildConfig *config) {
+    TRACE_SCOPE("write_starbuild");
+    FILE *fp = fopen(filename, "w");
+    if (!fp) {
+        return -1;
+    }
+    
+    // Local sources are looked up next to the STARBUILD being written
+    char base_dir[4096] = ".";
+    const char *slash = strrchr(filename, '/');
+    if (slash) {
+        snprintf(base_dir, sizeof(base_dir), "%.*s", (int)(slash - filename), filename);
+    }
+    
+    fprintf(fp, "# STARBUILD generated by StarbuildCreator\n");
+    fprintf(fp, "# build_key: %016llx\n\n", (unsigned long long)compute_build_key(config, base_dir));
+    
+    // Package information
+    if (config->package_count == 1) {
+        write_assignment(fp, "package_name", config->packages[0].name);
+        write_assignment(fp, "package_version", config->packages[0].version);
+        write_assignment(fp, "description", config->packages[0].description);
+        
+        // Write license array for single package
+        if (config->packages[0].license_count > 0) {
+            write_array(fp, "license", config->packages[0].license, config->packages[0].license_count);
+        }
+        fprintf(fp, "\n");
+    } else {
+        // Multiple packages
+        fprintf(fp, "package_name=( ");
+        for (int i = 0; i < config->package_count; i++) {
+            write_quoted(fp, config->packages[i].name);
+            fputc(' ', fp);
+        }
+        fprintf(fp, ")\n");
+        write_assignment(fp, "package_version", config->packages[0].version);
+        
+        fprintf(fp, "package_descriptions=( ");
+        for (int i = 0; i < config->package_count; i++) {
+            write_quoted(fp, config->packages[i].description);
+            fputc(' ', fp);
+        }
+        fprintf(fp, ")\n\n");
+    }
+    
+    // Dependencies
+    write_array(fp, "dependencies", config->global_deps, config->global_deps_count);
+    write_array(fp, "build_dependencies", config->build_deps, config->build_deps_count);
+    write_sources_array(fp, "sources", config->sources, config->sources_count);
+    
+    // Write options if any
+    if (config->options_count > 0) {
+        write_array(fp, "options", config->options, config->options_count);
+    }
+    
+    fprintf(fp, "\n");
+    
+    // Scripts
+    write_multiline_script(fp, "prepare", config->prepare_script, config->prepare_script_lines);
+    write_multiline_script(fp, "compile", config->compile_script, config->compile_script_lines);
+    write_multiline_script(fp, "verify", config->verify_script, config->verify_script_lines);
+    
+    // Assemble scripts
+    if (config->package_count == 1) {
+        write_multiline_script(fp, "assemble", config->assemble_scripts[0], config->assemble_script_lines[0]);
+    } else {
+        for (int i = 0; i < config->package_count; i++) {
+            char script_name[256];
+            snprintf(script_name, sizeof(script_name), "assemble_%s", config->packages[i].name);
+            write_multiline_script(fp, script_name, config->assemble_scripts[i], config->assemble_script_lines[i]);
+        }
+    }
+    
+    // Package-specific dependencies
+    if (config->package_count > 1) {
+        for (int i = 0; i < config->package_count; i++) {
+            if (config->packages[i].deps_count > 0) {
+                char deps_name[256];
+                snprintf(deps_name, sizeof(deps_name), "dependencies_%s", config->packages[i].name);
+                write_array(fp, deps_name, config->packages[i].deps, config->packages[i].deps_count);
+            }
+        }
+    }
+    
+    // Package-specific licenses
+    if (config->package_count > 1) {
+        for (int i = 0; i < config->package_count; i++) {
+            if (config->packages[i].license_count > 0) {
+                char license_name[256];
+                snprintf(license_name, sizeof(license_name), "license_%s", config->packages[i].name);
+                write_array(fp, license_name, config->packages[i].license, config->packages[i].license_count);
+            }
+        }
+    }
+    
+    // Advanced fields for single package
+    if (config->package_count == 1 && config->enable_advanced_fields) {
+        Package *p = &config->packages[0];
+        if (p->gives_count + p->provides_count > 0) {
+            write_merged_array(fp, "gives", p->gives, p->gives_count, p->provides, p->provides_count);
+        }
+        if (p->clashes_count + p->conflicts_count > 0) {
+            write_merged_array(fp, "clashes", p->clashes, p->clashes_count, p->conflicts, p->conflicts_count);
+        }
+        if (p->optional_dependencies_count + p->optional_count > 0) {
+            write_merged_array(fp, "optional_dependencies", p->optional_dependencies, p->optional_dependencies_count, p->optional, p->optional_count);
+        }
+    }
+    
+    // Advanced fields for multiple packages
+    if (config->package_count > 1 && config->enable_advanced_fields) {
+        for (int i = 0; i < config->package_count; i++) {
+            Package *p = &config->packages[i];
+            if (p->gives_count + p->provides_count > 0) {
+                char gives_name[256];
+                snprintf(gives_name, sizeof(gives_name), "gives_%s", p->name);
+                write_merged_array(fp, gives_name, p->gives, p->gives_count, p->provides, p->provides_count);
+            }
+            if (p->clashes_count + p->conflicts_count > 0) {
+                char clashes_name[256];
+                snprintf(clashes_name, sizeof(clashes_name), "clashes_%s", p->name);
+                write_merged_array(fp, clashes_name, p->clashes, p->clashes_count, p->conflicts, p->conflicts_count);
+            }
+            if (p->optional_dependencies_count + p->optional_count > 0) {
+                char optional_deps_name[256];
+                snprintf(optional_deps_name, sizeof(optional_deps_name), "optional_%s", p->name);
+                write_merged_array(fp, optional_deps_name, p->optional_dependencies, p->optional_dependencies_count, p->optional, p->optional_count);
+            }
+        }
+    }
+    
+    TRACE_COUNT(bytes_rendered, (uint64_t)ftell(fp));
+    TRACE_COUNT(files_written, 1);
+    int ok = !ferror(fp);
+    return fclose(fp) == 0 && ok ? 0 : -1;
+}
+
+void generate_starbuild_file(StarbuildConfig *config) {
+    TRACE_SCOPE("generate_starbuild_file");
+    if (write_starbuild("STARBUILD", config) < 0) {
+        print_error("Could not create STARBUILD file");
+        return;
+    }
+    print_success("STARBUILD file created successfully!");
+}
+
+// Main wizard function
+void run_wizard(StarbuildConfig *config) {
+    clear_screen();
+    printf("Welcome to StarbuildCreator!\n");
+    printf("This wizard will help you create a STARBUILD file.\n\n");
+    
+    // Check for existing STARBUILD file
+    if (access("STARBUILD", F_OK) == 0) {
+        print_warning("STARBUILD file already exists");
+        if (!get_yes_no("Overwrite existing file")) {
+            printf("Operation cancelled.\n");
+            return;
+        }
+    }
+    
+    // Run wizard steps
+    wizard_advanced_fields(config);
+    // Tarballs given with -s prefill the defaults of every prompt that follows
+    wizard_inspect_sources(config, 0);
+    wizard_basic_info(config);
+    wizard_dependencies(config);
+    wizard_sources(config);
+    wizard_advanced_package_fields(config);
+    wizard_scripts(config);
+    wizard_options(config);
+    
+    // Preview
+    print_header("Preview");
+    if (config->package_count == 1) {
+        printf("Package: %s %s\n", config->packages[0].name, config->packages[0].version);
+        printf("Description: %s\n", config->packages[0].description);
+        if (config->packages[0].license_count > 0) {
+            printf("License: ");
+            for (int i = 0; i < config->packages[0].license_count; i++) {
+                printf("%s ", config->packages[0].license[i]);
+            }
+            printf("\n");
+        }
+    } else {
+        printf("Packages:\n");
+        for (int i = 0; i < config->package_count; i++) {
+            printf("  - %s: %s\n", config->packages[i].name, config->packages[i].description);
+            if (config->packages[i].license_count > 0) {
+                printf("    License: ");
+                for (int j = 0; j < config->packages[i].license_count; j++) {
+                    printf("%s ", config->packages[i].license[j]);
+                }
+                printf("\n");
+            }
+        }
+    }
+    printf("Dependencies: ");
+    for (int i = 0; i < config->global_deps_count; i++) {
+        printf("%s ", config->global_deps[i]);
+    }
+    printf("\n");
+    
+    if (config->enable_advanced_fields && config->package_count == 1) {
+        if (config->packages[0].gives_count > 0) {
+            printf("Gives: ");
+            for (int i = 0; i < config->packages[0].gives_count; i++) {
+                printf("%s ", config->packages[0].gives[i]);
+            }
+            printf("\n");
+        }
+        if (config->packages[0].clashes_count > 0) {
+            printf("Clashes: ");
+            for (int i = 0; i < config->packages[0].clashes_count; i++) {
+                printf("%s ", config->packages[0].clashes[i]);
+            }
+            printf("\n");
+        }
+        if (config->packages[0].optional_dependencies_count > 0) {
+            printf("Optional dependencies: ");
+            for (int i = 0; i < config->packages[0].optional_dependencies_count; i++) {
+                printf("%s ", config->packages[0].optional_dependencies[i]);
+            }
+            printf("\n");
+        }
+    }
+    
+    if (config->options_count > 0) {
+        printf("Options: ");
+        for (int i = 0; i < config->options_count; i++) {
+            printf("%s ", config->options[i]);
+        }
+        printf("\n");
+    }
+    
+    if (get_yes_no("Generate STARBUILD file")) {
+        generate_starbuild_file(config);
+        
+        if (get_yes_no("Save as template for future use")) {
+            get_input("Template name", config->template_name, sizeof(config->template_name));
+            save_template(config->template_name, config);
+        }
+    } else {
+        printf("Operation cancelled.\n");
+    }
+}
+
+// Quick mode function
+void quick_mode(const char *package_name, const char *version, const char *description) {
+    StarbuildConfig config = {0};
+    
+    strcpy(config.packages[0].name, package_name);
+    strcpy(config.packages[0].version, version);
+    strcpy(config.packages[0].description, description);
+    config.package_count = 1;
+    config.enable_advanced_fields = 0;
+    config.options_count = 0; // No options in quick mode
+    
+    generate_starbuild_file(&config);
+    print_success("Quick STARBUILD file created!");
+}
+
+// Build runner
+#define MAX_PHASES (MAX_PACKAGES + 3)
+
+typedef struct {
+    char name[256];
+    double start_us;
+    double wall_us;
+    double user_us;
+    double sys_us;
+    long maxrss_kb;
+    long long read_bytes;
+    long long write_bytes;
+    int exit_code;
+} PhaseResult;
+
+double timeval_us(struct timeval tv) {
+    return tv.tv_sec * 1e6 + tv.tv_usec;
+}
+
+// Collect the build phases defined in a STARBUILD, in the order they run
+int find_phases(const char *path, char phases[][256], int max_phases) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return -1;
+    }
+
+    const char *fixed[] = { "prepare", "compile", "verify" };
+    int have_fixed[3] = {0};
+    char assembles[MAX_PHASES][256];
+    int assemble_count = 0;
+    char line[MAX_LINE];
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char *paren = strstr(line, "() {");
+        if (!paren || paren == line) {
+            continue;
+        }
+        *paren = '\0';
+        if (strlen(line) >= sizeof(assembles[0])) {
+            // A phase we cannot name exactly would run the wrong function
+            fprintf(stderr, "%s: function name '%.40s...' is longer than %zu characters\n",
+                    path, line, sizeof(assembles[0]) - 1);
+            fclose(fp);
+            return -2;
+        }
+        for (int i = 0; i < 3; i++) {
+            if (strcmp(line, fixed[i]) == 0) {
+                have_fixed[i] = 1;
+            }
+        }
+        if ((strcmp(line, "assemble") == 0 || strncmp(line, "assemble_", 9) == 0) && assemble_count < MAX_PHASES) {
+            strcpy(assembles[assemble_count++], line);
+        }
+    }
+    fclose(fp);
+
+    int count = 0;
+    for (int i = 0; i < 3 && count < max_phases; i++) {
+        if (have_fixed[i]) {
+            strcpy(phases[count++], fixed[i]);
+        }
+    }
+    for (int i = 0; i < assemble_count && count < max_phases; i++) {
+        strcpy(phases[count++], assembles[i]);
+    }
+    return count;
+}
+
+// Source the STARBUILD in a fresh shell and run a single phase function in it
+int run_phase(const char *path, const char *phase, PhaseResult *result) {
+    static const char *runner =
+        "set -e\n"
+        "startdir=\"$PWD\"\n"
+        "srcdir=\"${srcdir:-$startdir/src}\"\n"
+        ". \"$1\"\n"
+        "case \"$2\" in\n"
+        "    assemble_*) pkgdir=\"${pkgdir:-$startdir/pkg/${2#assemble_}}\"; mkdir -p \"$pkgdir\" ;;\n"
+        "    assemble) pkgdir=\"${pkgdir:-$startdir/pkg/$package_name}\"; mkdir -p \"$pkgdir\" ;;\n"
+        "esac\n"
+        "mkdir -p \"$srcdir\"\n"
+        "cd \"$srcdir\"\n"
+        "\"$2\"\n";
+
+    char script_path[MAX_LINE];
+    if (path[0] == '/') {
+        snprintf(script_path, sizeof(script_path), "%s", path);
+    } else {
+        char cwd[512];
+        if (getcwd(cwd, sizeof(cwd)) == NULL) {
+            return -1;
+        }
+        snprintf(script_path, sizeof(script_path), "%s/%s", cwd, path);
+    }
+
+    memset(result, 0, sizeof(*result));
+    snprintf(result->name, sizeof(result->name), "%s", phase);
+    fflush(stdout);
+
+    result->start_us = monotonic_us();
+    pid_t pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        execl("/bin/bash", "bash", "-c", runner, "bash", script_path, phase, (char *)NULL);
+        _exit(127);
+    }
+
+    int status = 0;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0) {
+        return -1;
+    }
+    result->wall_us = monotonic_us() - result->start_us;
+    result->user_us = timeval_us(usage.ru_utime);
+    result->sys_us = timeval_us(usage.ru_stime);
+    result->maxrss_kb = usage.ru_maxrss;
+    // Block counts are in 512-byte units and only cover real device I/O
+    result->read_bytes = (long long)usage.ru_inblock * 512;
+    result->write_bytes = (long long)usage.ru_oublock * 512;
+    result->exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    return 0;
+}
+
+void print_profile_table(PhaseResult *results, int count) {
+    double total_wall = 0;
+    for (int i = 0; i < count; i++) {
+        total_wall += results[i].wall_us;
+    }
+
+    print_header("Build Profile");
+    printf("%-24s %9s %9s %9s %6s %6s %10s %10s %10s\n",
+           "Phase", "Wall(s)", "User(s)", "Sys(s)", "CPU%", "Share", "RSS(MB)", "Read(MB)", "Write(MB)");
+    for (int i = 0; i < count; i++) {
+        PhaseResult *r = &results[i];
+        double cpu = r->wall_us > 0 ? (r->user_us + r->sys_us) / r->wall_us * 100.0 : 0.0;
+        double share = total_wall > 0 ? r->wall_us / total_wall * 100.0 : 0.0;
+        printf("%-24s %9.2f %9.2f %9.2f %5.0f%% %5.1f%% %10.1f %10.1f %10.1f%s\n",
+               r->name, r->wall_us / 1e6, r->user_us / 1e6, r->sys_us / 1e6, cpu, share,
+               r->maxrss_kb / 1024.0, r->read_bytes / 1048576.0, r->write_bytes / 1048576.0,
+               r->exit_code ? "  (failed)" : "");
+    }
+    printf("%-24s %9.2f\n", "Total", total_wall / 1e6);
+
+    // Point out the phases people usually want to know about
+    for (int i = 0; i < count; i++) {
+        PhaseResult *r = &results[i];
+        char msg[512];
+        if (total_wall > 0 && count > 1 && r->wall_us / total_wall > 0.5) {
+            snprintf(msg, sizeof(msg), "%s dominates the build (%.0f%% of wall time)", r->name, r->wall_us / total_wall * 100.0);
+            print_warning(msg);
+        }
+        if (strcmp(r->name, "compile") == 0 && r->wall_us > 5e6 &&
+            (r->user_us + r->sys_us) < r->wall_us * 1.2) {
+            print_warning("compile used about one CPU; it may not be running in parallel");
+        }
+    }
+}
+
+int write_profile_trace(const char *filename, PhaseResult *results, int count) {
+    FILE *fp = fopen(filename, "w");
+    if (!fp) {
+        return -1;
+    }
+
+    double origin = count > 0 ? results[0].start_us : 0;
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (int i = 0; i < count; i++) {
+        PhaseResult *r = &results[i];
+        fprintf(fp, "{\"name\":");
+        json_write_string(fp, r->name);
+        fprintf(fp, ",\"cat\":\"phase\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.0f,\"dur\":%.0f,"
+                    "\"args\":{\"user_ms\":%.1f,\"sys_ms\":%.1f,\"maxrss_kb\":%ld,"
+                    "\"read_bytes\":%lld,\"write_bytes\":%lld,\"exit_code\":%d}}%s\n",
+                r->start_us - origin, r->wall_us, r->user_us / 1e3, r->sys_us / 1e3, r->maxrss_kb,
+                r->read_bytes, r->write_bytes, r->exit_code, i + 1 < count ? "," : "");
+    }
+    fprintf(fp, "]}\n");
+    fclose(fp);
+    return 0;
+}
+
+// Build history store
+//
+// The store is an append-only file of fixed-size records behind a small
+// header, so queries can mmap it and walk records without parsing text.
+#define HISTORY_FILE ".starbuild-history"
+#define HISTORY_MAGIC "SBHIST01"
+#define HISTORY_DEFAULT_RUNS 10
+#define HISTORY_MIN_SAMPLES 3
+#define HISTORY_MIN_DELTA_US 100000
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+} HistoryHeader;
+
+typedef struct {
+    uint64_t package_hash;
+    int64_t timestamp;
+    char package[64];
+    char version[32];
+    char phase[32];
+    uint64_t wall_us;
+    uint64_t user_us;
+    uint64_t sys_us;
+    uint32_t maxrss_kb;
+    uint32_t jobs;
+} HistoryRecord;
+
+typedef struct {
+    uint64_t package_hash;
+    char package[64];
+    char phase[32];
+    char latest_version[32];
+    double walls[HISTORY_DEFAULT_RUNS * 10 + 1];
+    int wall_count;
+} HistoryGroup;
+
+// Read a scalar (or the first element of an array) assigned in a STARBUILD
+int read_starbuild_var(const char *path, const char *name, char *value, size_t size) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return -1;
+    }
+
+    size_t name_len = strlen(name);
+    char line[MAX_LINE];
+    int found = -1;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strncmp(line, name, name_len) != 0 || line[name_len] != '=') {
+            continue;
+        }
+        char *start = line + name_len + 1;
+        if (*start == '(') {
+            start++;
+        }
+        while (*start == ' ') {
+            start++;
+        }
+        if (*start == '\'') {
+            start++;
+            start[strcspn(start, "'")] = '\0';
+        } else if (*start == '"') {
+            // Undo write_quoted's backslash escapes
+            char *out = start;
+            for (char *in = start + 1; *in && *in != '"'; in++) {
+                if (*in == '\\' && in[1]) {
+                    in++;
+                }
+                *out++ = *in;
+            }
+            *out = '\0';
+        } else {
+            start[strcspn(start, " )\n")] = '\0';
+        }
+        snprintf(value, size, "%s", start);
+        found = 0;
+        break;
+    }
+    fclose(fp);
+    return found;
+}
+
+int detect_job_count() {
+    const char *makeflags = getenv("MAKEFLAGS");
+    if (makeflags) {
+        const char *j = strstr(makeflags, "-j");
+        if (j && isdigit((unsigned char)j[2])) {
+            return atoi(j + 2);
+        }
+        j = strstr(makeflags, "--jobs=");
+        if (j) {
+            return atoi(j + 7);
+        }
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+}
+
+int history_append(const char *store, const char *package, const char *version,
+                   PhaseResult *results, int count, int jobs) {
+    int fd = open(store, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size == 0) {
+        HistoryHeader header = {0};
+        memcpy(header.magic, HISTORY_MAGIC, sizeof(header.magic));
+        header.version = 1;
+        header.record_size = sizeof(HistoryRecord);
+        if (write(fd, &header, sizeof(header)) != (ssize_t)sizeof(header)) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    // One write per run keeps concurrent appenders from interleaving records
+    HistoryRecord records[MAX_PHASES];
+    memset(records, 0, sizeof(records));
+    int64_t now = (int64_t)time(NULL);
+    for (int i = 0; i < count; i++) {
+        HistoryRecord *r = &records[i];
+        r->package_hash = hash_string(package);
+        r->timestamp = now;
+        snprintf(r->package, sizeof(r->package), "%s", package);
+        snprintf(r->version, sizeof(r->version), "%s", version);
+        snprintf(r->phase, sizeof(r->phase), "%.*s", (int)sizeof(r->phase) - 1, results[i].name);
+        r->wall_us = (uint64_t)results[i].wall_us;
+        r->user_us = (uint64_t)results[i].user_us;
+        r->sys_us = (uint64_t)results[i].sys_us;
+        r->maxrss_kb = (uint32_t)results[i].maxrss_kb;
+        r->jobs = (uint32_t)jobs;
+    }
+
+    size_t bytes = sizeof(HistoryRecord) * count;
+    int ok = write(fd, records, bytes) == (ssize_t)bytes;
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+// Map the store read-only; returns the record array and its length
+const HistoryRecord *history_map(const char *store, size_t *count, void **mapping, size_t *mapping_size) {
+    int fd = open(store, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(HistoryHeader)) {
+        close(fd);
+        return NULL;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+
+    const HistoryHeader *header = data;
+    if (memcmp(header->magic, HISTORY_MAGIC, sizeof(header->magic)) != 0 ||
+        header->record_size != sizeof(HistoryRecord)) {
+        munmap(data, st.st_size);
+        return NULL;
+    }
+
+    *mapping = data;
+    *mapping_size = st.st_size;
+    *count = (st.st_size - sizeof(HistoryHeader)) / sizeof(HistoryRecord);
+    return (const HistoryRecord *)((const char *)data + sizeof(HistoryHeader));
+}
+
+// First record at or after a timestamp; records are appended in time order
+size_t history_lower_bound(const HistoryRecord *records, size_t count, int64_t since) {
+    size_t lo = 0;
+    size_t hi = count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (records[mid].timestamp < since) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+double median_of(double *values, int count) {
+    qsort(values, count, sizeof(double), compare_doubles);
+    if (count % 2) {
+        return values[count / 2];
+    }
+    return (values[count / 2 - 1] + values[count / 2]) / 2.0;
+}
+
+// Index key for a (package, phase) group; phase is a fixed-width record field
+uint64_t history_group_key(uint64_t package_hash, const char *phase) {
+    return fnv1a64(phase, strnlen(phase, sizeof(((HistoryRecord *)0)->phase)), package_hash);
+}
+
+// Compare the latest run against the median/MAD of the runs before it
+void print_history_group(HistoryGroup *group, double threshold) {
+    double latest = group->walls[0];
+    int previous = group->wall_count - 1;
+
+    printf("%-24s %-16s %-12s %9.2f", group->package, group->phase, group->latest_version, latest / 1e6);
+    if (previous < HISTORY_MIN_SAMPLES) {
+        printf("  (not enough history)\n");
+        return;
+    }
+
+    double samples[HISTORY_DEFAULT_RUNS * 10];
+    memcpy(samples, group->walls + 1, previous * sizeof(double));
+    double median = median_of(samples, previous);
+    for (int i = 0; i < previous; i++) {
+        samples[i] = fabs(group->walls[i + 1] - median);
+    }
+    double mad = median_of(samples, previous) * 1.4826;
+    double change = median > 0 ? (latest - median) / median * 100.0 : 0.0;
+
+    printf(" %9.2f %9.2f %+8.1f%%", median / 1e6, mad / 1e6, change);
+    // Require both a relative slowdown and one well outside normal run-to-run noise
+    if (change > threshold && latest - median > 3.0 * mad && latest - median > HISTORY_MIN_DELTA_US) {
+        printf("  ");
+        print_disabled("REGRESSION");
+    }
+    printf("\n");
+}
+
+// History mode function
+int history_mode(int argc, char *argv[]) {
+    const char *store = HISTORY_FILE;
+    const char *package = NULL;
+    int runs = HISTORY_DEFAULT_RUNS;
+    double threshold = 10.0;
+    int since_days = 0;
+
+    const char *usage = "Usage: history [PKG] [--store FILE] [--last N] [--threshold PCT] [--since DAYS]\n";
+    for (int i = 0; i < argc; i++) {
+        int is_option = strcmp(argv[i], "--store") == 0 || strcmp(argv[i], "--last") == 0 ||
+                        strcmp(argv[i], "--threshold") == 0 || strcmp(argv[i], "--since") == 0;
+        if (is_option && i + 1 >= argc) {
+            fprintf(stderr, "history: %s needs a value\n%s", argv[i], usage);
+            return 1;
+        }
+        if (strcmp(argv[i], "--store") == 0) {
+            store = argv[++i];
+        } else if (strcmp(argv[i], "--last") == 0) {
+            runs = atoi(argv[++i]);
+            if (runs < 1) {
+                fprintf(stderr, "history: --last must be a positive number of runs\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--threshold") == 0) {
+            threshold = atof(argv[++i]);
+            if (!(threshold > 0)) {
+                fprintf(stderr, "history: --threshold must be a positive percentage\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--since") == 0) {
+            since_days = atoi(argv[++i]);
+        } else if (argv[i][0] == '-' && argv[i][1]) {
+            fprintf(stderr, "history: unknown option %s\n%s", argv[i], usage);
+            return 1;
+        } else if (package) {
+            fprintf(stderr, "history: only one package can be given\n%s", usage);
+            return 1;
+        } else {
+            package = argv[i];
+        }
+    }
+    if (runs > HISTORY_DEFAULT_RUNS * 10) {
+        runs = HISTORY_DEFAULT_RUNS * 10;
+    }
+
+    size_t count = 0;
+    void *mapping = NULL;
+    size_t mapping_size = 0;
+    const HistoryRecord *records = history_map(store, &count, &mapping, &mapping_size);
+    if (!records) {
+        print_error("Could not read build history");
+        return 1;
+    }
+
+    size_t first = 0;
+    if (since_days > 0) {
+        first = history_lower_bound(records, count, (int64_t)time(NULL) - (int64_t)since_days * 86400);
+    }
+    uint64_t wanted = package ? hash_string(package) : 0;
+
+    // Walk newest to oldest so each group sees its latest run first
+    HistoryGroup *groups = NULL;
+    int group_count = 0;
+    int group_capacity = 0;
+    int *slots = NULL;
+    size_t slot_count = 0;
+    for (size_t i = count; i > first; i--) {
+        const HistoryRecord *r = &records[i - 1];
+        // Stored names are cut to the record field; the hash covers the full name
+        if (package && (r->package_hash != wanted || strncmp(r->package, package, sizeof(r->package) - 1) != 0)) {
+            continue;
+        }
+
+        // Groups are found through an open-addressed index keyed by (package, phase)
+        if ((size_t)(group_count + 1) * 2 > slot_count) {
+            slot_count = slot_count ? slot_count * 2 : 64;
+            free(slots);
+            slots = malloc(slot_count * sizeof(int));
+            memset(slots, -1, slot_count * sizeof(int));
+            for (int g = 0; g < group_count; g++) {
+                size_t s = history_group_key(groups[g].package_hash, groups[g].phase) & (slot_count - 1);
+                while (slots[s] >= 0) {
+                    s = (s + 1) & (slot_count - 1);
+                }
+                slots[s] = g;
+            }
+        }
+        size_t slot = history_group_key(r->package_hash, r->phase) & (slot_count - 1);
+        HistoryGroup *group = NULL;
+        while (slots[slot] >= 0) {
+            HistoryGroup *candidate = &groups[slots[slot]];
+            if (candidate->package_hash == r->package_hash &&
+                strncmp(candidate->phase, r->phase, sizeof(r->phase)) == 0 &&
+                strncmp(candidate->package, r->package, sizeof(r->package)) == 0) {
+                group = candidate;
+                break;
+            }
+            slot = (slot + 1) & (slot_count - 1);
+        }
+        if (!group) {
+            if (group_count == group_capacity) {
+                group_capacity = group_capacity ? group_capacity * 2 : 16;
+                groups = realloc(groups, group_capacity * sizeof(HistoryGroup));
+            }
+            slots[slot] = group_count;
+            group = &groups[group_count++];
+            memset(group, 0, sizeof(*group));
+            group->package_hash = r->package_hash;
+            memcpy(group->package, r->package, sizeof(group->package));
+            memcpy(group->phase, r->phase, sizeof(group->phase));
+            memcpy(group->latest_version, r->version, sizeof(group->latest_version));
+        }
+        if (group->wall_count <= runs) {
+            group->walls[group->wall_count++] = (double)r->wall_us;
+        }
+
+        if (package && group->wall_count <= runs) {
+            char when[32];
+            time_t ts = (time_t)r->timestamp;
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&ts));
+            printf("%s  %-12.32s %-16.32s %9.2fs wall %9.2fs cpu %8.1f MB  -j%u\n",
+                   when, r->version, r->phase, r->wall_us / 1e6, (r->user_us + r->sys_us) / 1e6,
+                   r->maxrss_kb / 1024.0, r->jobs);
+        }
+    }
+
+    print_header("Build History");
+    printf("%-24s %-16s %-12s %9s %9s %9s %9s\n", "Package", "Phase", "Version", "Latest(s)", "Median(s)", "MAD(s)", "Change");
+    for (int g = 0; g < group_count; g++) {
+        print_history_group(&groups[g], threshold);
+    }
+    if (group_count == 0) {
+        print_warning("No matching build history");
+    }
+
+    free(slots);
+    free(groups);
+    munmap(mapping, mapping_size);
+    return 0;
+}
+
+// Run mode function
+int run_mode(int argc, char *argv[]) {
+    const char *path = "STARBUILD";
+    const char *trace_file = "starbuild-profile.json";
+    const char *store = HISTORY_FILE;
+    int profile = 0;
+    int record = 1;
+
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--profile") == 0) {
+            profile = 1;
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            trace_file = argv[++i];
+        } else if (strcmp(argv[i], "--store") == 0 && i + 1 < argc) {
+            store = argv[++i];
+        } else if (strcmp(argv[i], "--no-history") == 0) {
+            record = 0;
+        } else {
+            path = argv[i];
+        }
+    }
+
+    char phases[MAX_PHASES][256];
+    int phase_count = find_phases(path, phases, MAX_PHASES);
+    if (phase_count == -2) {
+        print_error("STARBUILD has a phase function with an over-long name");
+        return 1;
+    }
+    if (phase_count < 0) {
+        print_error("Could not open STARBUILD file");
+        return 1;
+    }
+    if (phase_count == 0) {
+        print_warning("No build phases found");
+        return 0;
+    }
+
+    PhaseResult results[MAX_PHASES];
+    int ran = 0;
+    int failed = 0;
+    for (int i = 0; i < phase_count; i++) {
+        printf("==> Running %s\n", phases[i]);
+        if (run_phase(path, phases[i], &results[ran]) < 0) {
+            print_error("Could not start build phase");
+            failed = 1;
+            break;
+        }
+        ran++;
+        if (results[ran - 1].exit_code != 0) {
+            char msg[sizeof(phases[i]) + 64];
+            snprintf(msg, sizeof(msg), "%.*s failed with exit code %d", (int)sizeof(phases[i]) - 1, phases[i],
+                     results[ran - 1].exit_code);
+            print_error(msg);
+            failed = 1;
+            break;
+        }
+    }
+
+    if (profile && ran > 0) {
+        print_profile_table(results, ran);
+        if (write_profile_trace(trace_file, results, ran) == 0) {
+            char msg[512];
+            snprintf(msg, sizeof(msg), "Trace written to %s", trace_file);
+            print_success(msg);
+        } else {
+            print_error("Could not write trace file");
+        }
+    }
+
+    // Only complete builds are comparable from one run to the next
+    if (record && !failed) {
+        char package[256] = "unknown";
+        char version[64] = "";
+        read_starbuild_var(path, "package_name", package, sizeof(package));
+        read_starbuild_var(path, "package_version", version, sizeof(version));
+        if (history_append(store, package, version, results, ran, detect_job_count()) < 0) {
+            print_warning("Could not record build history");
+        }
+    }
+
+    return failed;
+}
+
+// Static shell parser
+//
+// Reads the subset of bash used by PKGBUILD/STARBUILD files without running
+// it: top-level scalar and array assignments, and function definitions.
+// Variable references to earlier assignments are expanded; anything that
+// would need a real shell is left as-is and reported as an issue.
+typedef struct {
+    char *name;
+    char **values;
+    int value_count;
+    int is_array;
+    char *body;
+    int line;
+    int append;     // first assignment in this document used +=
+} ShellItem;
+
+typedef struct {
+    ShellItem *items;
+    int count;
+    int capacity;
+    StrBuf issues;
+    int issue_count;
+} ShellDoc;
+
+typedef struct {
+    const char *p;
+    const char *end;
+    int line;
+    ShellDoc *doc;
+    ShellDoc *vars;
+} ShellParser;
+
+void shell_issue(ShellDoc *doc, int line, const char *fmt, ...) {
+    char buffer[MAX_LINE];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buffer, sizeof(buffer), fmt, args);
+    va_end(args);
+    sb_printf(&doc->issues, "    line %d: %s\n", line, buffer);
+    doc->issue_count++;
+}
+
+ShellItem *shell_find(ShellDoc *doc, const char *name) {
+    for (int i = doc->count - 1; i >= 0; i--) {
+        if (!doc->items[i].body && strcmp(doc->items[i].name, name) == 0) {
+            return &doc->items[i];
+        }
+    }
+    return NULL;
+}
+
+ShellItem *shell_find_function(ShellDoc *doc, const char *name) {
+    for (int i = doc->count - 1; i >= 0; i--) {
+        if (doc->items[i].body && strcmp(doc->items[i].name, name) == 0) {
+            return &doc->items[i];
+        }
+    }
+    return NULL;
+}
+
+ShellItem *shell_add(ShellDoc *doc, const char *name, size_t name_len, int line) {
+    if (doc->count == doc->capacity) {
+        doc->capacity = doc->capacity ? doc->capacity * 2 : 32;
+        doc->items = realloc(doc->items, doc->capacity * sizeof(ShellItem));
+    }
+    ShellItem *item = &doc->items[doc->count++];
+    memset(item, 0, sizeof(*item));
+    item->name = strndup(name, name_len);
+    item->line = line;
+    return item;
+}
+
+void shell_add_value(ShellItem *item, char *value) {
+    item->values = realloc(item->values, (item->value_count + 1) * sizeof(char *));
+    item->values[item->value_count++] = value;
+}
+
+void shell_doc_free(ShellDoc *doc) {
+    for (int i = 0; i < doc->count; i++) {
+        free(doc->items[i].name);
+        for (int j = 0; j < doc->items[i].value_count; j++) {
+            free(doc->items[i].values[j]);
+        }
+        free(doc->items[i].values);
+        free(doc->items[i].body);
+    }
+    free(doc->items);
+    free(doc->issues.data);
+    memset(doc, 0, sizeof(*doc));
+}
+
+int is_name_char(char c) {
+    return isalnum((unsigned char)c) || c == '_';
+}
+
+// Copy a $(...) construct (starting at its '(') or the rest of a `...` verbatim
+void shell_copy_balanced(ShellParser *ps, StrBuf *out, char open, char close) {
+    int depth = open == close ? 1 : 0;
+    while (ps->p < ps->end) {
+        char c = *ps->p++;
+        sb_putc(out, c);
+        if (c == '\n') {
+            ps->line++;
+        } else if (c == '\\' && ps->p < ps->end) {
+            sb_putc(out, *ps->p++);
+        } else if (c == close) {
+            if (--depth == 0) {
+                return;
+            }
+        } else if (c == open) {
+            depth++;
+        }
+    }
+}
+
+void shell_expand(ShellParser *ps, StrBuf *out) {
+    // ps->p is just past the '$'
+    if (ps->p >= ps->end) {
+        sb_putc(out, '$');
+        return;
+    }
+
+    if (*ps->p == '(') {
+        shell_issue(ps->doc, ps->line, "command substitution is not translated");
+        sb_putc(out, '$');
+        shell_copy_balanced(ps, out, '(', ')');
+        return;
+    }
+
+    const char *name = NULL;
+    size_t name_len = 0;
+    const char *start = ps->p;
+    if (*ps->p == '{') {
+        const char *close = memchr(ps->p, '}', ps->end - ps->p);
+        if (!close) {
+            sb_putc(out, '$');
+            return;
+        }
+        name = ps->p + 1;
+        while (name + name_len < close && is_name_char(name[name_len])) {
+            name_len++;
+        }
+        ps->p = close + 1;
+        if (name_len == 0 || name + name_len != close) {
+            shell_issue(ps->doc, ps->line, "unsupported expansion ${%.*s}", (int)(close - start - 1), start + 1);
+            sb_putc(out, '$');
+            sb_append(out, start, ps->p - start);
+            return;
+        }
+    } else if (is_name_char(*ps->p) && !isdigit((unsigned char)*ps->p)) {
+        name = ps->p;
+        while (ps->p < ps->end && is_name_char(*ps->p)) {
+            ps->p++;
+        }
+        name_len = ps->p - name;
+    } else {
+        sb_putc(out, '$');
+        return;
+    }
+
+    char key[256];
+    snprintf(key, sizeof(key), "%.*s", (int)name_len, name);
+    ShellItem *var = ps->vars ? shell_find(ps->vars, key) : NULL;
+    if (var && var->value_count > 0) {
+        sb_append(out, var->values[0], strlen(var->values[0]));
+    } else if (var) {
+        // Defined but empty
+    } else {
+        shell_issue(ps->doc, ps->line, "unresolved variable $%s", key);
+        sb_putc(out, '$');
+        sb_append(out, start, ps->p - start);
+    }
+}
+
+// Parse one shell word, applying quote removal and variable expansion
+char *shell_word(ShellParser *ps) {
+    StrBuf out = {0};
+    int have_word = 0;
+
+    while (ps->p < ps->end) {
+        char c = *ps->p;
+        if (c == ' ' || c == '\t' || c == '\n' || c == ';' || c == '(' || c == ')' ||
+            c == '&' || c == '|' || c == '<' || c == '>') {
+            break;
+        }
+        have_word = 1;
+        ps->p++;
+
+        if (c == '\'') {
+            const char *close = memchr(ps->p, '\'', ps->end - ps->p);
+            if (!close) {
+                close = ps->end;
+            }
+            for (const char *q = ps->p; q < close; q++) {
+                ps->line += *q == '\n';
+            }
+            sb_append(&out, ps->p, close - ps->p);
+            ps->p = close < ps->end ? close + 1 : close;
+        } else if (c == '"') {
+            while (ps->p < ps->end && *ps->p != '"') {
+                char d = *ps->p++;
+                if (d == '\\' && ps->p < ps->end && strchr("$`\"\\\n", *ps->p)) {
+                    if (*ps->p == '\n') {
+                        ps->line++;
+                    } else {
+                        sb_putc(&out, *ps->p);
+                    }
+                    ps->p++;
+                } else if (d == '$') {
+                    shell_expand(ps, &out);
+                } else if (d == '`') {
+                    shell_issue(ps->doc, ps->line, "command substitution is not translated");
+                    sb_putc(&out, d);
+                    shell_copy_balanced(ps, &out, '`', '`');
+                } else {
+                    ps->line += d == '\n';
+                    sb_putc(&out, d);
+                }
+            }
+            if (ps->p < ps->end) {
+                ps->p++;
+            }
+        } else if (c == '\\') {
+            if (ps->p < ps->end) {
+                if (*ps->p == '\n') {
+                    ps->line++;
+                } else {
+                    sb_putc(&out, *ps->p);
+                }
+                ps->p++;
+            }
+        } else if (c == '$') {
+            shell_expand(ps, &out);
+        } else if (c == '`') {
+            shell_issue(ps->doc, ps->line, "command substitution is not translated");
+            sb_putc(&out, c);
+            shell_copy_balanced(ps, &out, '`', '`');
+        } else {
+            if (c == '{') {
+                const char *close = memchr(ps->p, '}', ps->end - ps->p);
+                const char *comma = close ? memchr(ps->p, ',', close - ps->p) : NULL;
+                if (comma && !memchr(ps->p, ' ', close - ps->p) && !memchr(ps->p, '\n', close - ps->p)) {
+                    shell_issue(ps->doc, ps->line, "brace expansion is not translated");
+                }
+            }
+            sb_putc(&out, c);
+        }
+    }
+
+    if (!have_word) {
+        free(out.data);
+        return NULL;
+    }
+    if (!out.data) {
+        sb_append(&out, "", 0);
+    }
+    return out.data;
+}
+
+void shell_skip_blank(ShellParser *ps, int newlines) {
+    while (ps->p < ps->end) {
+        if (*ps->p == ' ' || *ps->p == '\t' || (*ps->p == '\\' && ps->p + 1 < ps->end && ps->p[1] == '\n')) {
+            if (*ps->p == '\\') {
+                ps->p++;
+                ps->line++;
+            }
+            ps->p++;
+        } else if (newlines && *ps->p == '\n') {
+            ps->line++;
+            ps->p++;
+        } else if (newlines && *ps->p == '#') {
+            while (ps->p < ps->end && *ps->p != '\n') {
+                ps->p++;
+            }
+        } else {
+            break;
+        }
+    }
+}
+
+// Find the end of a { ... } body, honouring quotes, comments and heredocs
+const char *shell_body_end(ShellParser *ps) {
+    int depth = 0;
+    const char *p = ps->p;
+    int line = ps->line;
+    char heredoc[64] = "";
+
+    while (p < ps->end) {
+        char c = *p;
+        if (c == '\n') {
+            line++;
+            p++;
+            if (heredoc[0]) {
+                // Skip lines until the terminator, allowing <<- indentation
+                while (p < ps->end) {
+                    const char *eol = memchr(p, '\n', ps->end - p);
+                    if (!eol) {
+                        eol = ps->end;
+                    }
+                    const char *text = p;
+                    while (text < eol && (*text == '\t' || *text == ' ')) {
+                        text++;
+                    }
+                    int done = (size_t)(eol - text) == strlen(heredoc) && memcmp(text, heredoc, eol - text) == 0;
+                    p = eol < ps->end ? eol + 1 : eol;
+                    line++;
+                    if (done) {
+                        break;
+                    }
+                }
+                heredoc[0] = '\0';
+            }
+            continue;
+        }
+        if (c == '\\') {
+            p += 2;
+            continue;
+        }
+        if (c == '\'' ) {
+            const char *close = memchr(p + 1, '\'', ps->end - p - 1);
+            if (!close) {
+                break;
+            }
+            for (const char *q = p; q < close; q++) {
+                line += *q == '\n';
+            }
+            p = close + 1;
+            continue;
+        }
+        if (c == '"') {
+            p++;
+            while (p < ps->end && *p != '"') {
+                if (*p == '\\') {
+                    p++;
+                }
+                line += p < ps->end && *p == '\n';
+                p++;
+            }
+            p++;
+            continue;
+        }
+        if (c == '#' && (p == ps->p || isspace((unsigned char)p[-1]) || p[-1] == ';')) {
+            while (p < ps->end && *p != '\n') {
+                p++;
+            }
+            continue;
+        }
+        if (c == '<' && p + 2 < ps->end && p[1] == '<' && p[2] != '<') {
+            const char *q = p + 2;
+            if (*q == '-') {
+                q++;
+            }
+            while (q < ps->end && (*q == ' ' || *q == '\t')) {
+                q++;
+            }
+            size_t n = 0;
+            while (q < ps->end && !isspace((unsigned char)*q) && *q != ';' && *q != ')' && n + 1 < sizeof(heredoc)) {
+                if (*q != '\'' && *q != '"') {
+                    heredoc[n++] = *q;
+                }
+                q++;
+            }
+            heredoc[n] = '\0';
+            p = q;
+            continue;
+        }
+        if (c == '{') {
+            depth++;
+        } else if (c == '}') {
+            depth--;
+            if (depth == 0) {
+                ps->line = line;
+                return p;
+            }
+        }
+        p++;
+    }
+    ps->line = line;
+    return NULL;
+}
+
+void shell_skip_statement(ShellParser *ps) {
+    while (ps->p < ps->end && *ps->p != '\n') {
+        if (*ps->p == '\\' && ps->p + 1 < ps->end) {
+            ps->line += ps->p[1] == '\n';
+            ps->p += 2;
+            continue;
+        }
+        if (*ps->p == '\'' || *ps->p == '"') {
+            free(shell_word(ps));
+            continue;
+        }
+        ps->p++;
+    }
+}
+
+void shell_parse_assignment(ShellParser *ps, const char *name, size_t name_len, int append) {
+    char key[256];
+    snprintf(key, sizeof(key), "%.*s", (int)name_len, name);
+    ShellItem *item = append ? shell_find(ps->doc, key) : NULL;
+    if (!item) {
+        item = shell_add(ps->doc, name, name_len, ps->line);
+        item->append = append;
+    }
+
+    if (ps->p < ps->end && *ps->p == '(') {
+        ps->p++;
+        item->is_array = 1;
+        while (1) {
+            shell_skip_blank(ps, 1);
+            if (ps->p >= ps->end) {
+                shell_issue(ps->doc, item->line, "unterminated array '%s'", item->name);
+                return;
+            }
+            if (*ps->p == ')') {
+                ps->p++;
+                return;
+            }
+            char *word = shell_word(ps);
+            if (!word) {
+                shell_issue(ps->doc, ps->line, "unexpected '%c' in array '%s'", *ps->p, item->name);
+                ps->p++;
+                continue;
+            }
+            shell_add_value(item, word);
+        }
+    }
+
+    char *word = shell_word(ps);
+    shell_add_value(item, word ? word : strdup(""));
+}
+
+int shell_parse(ShellDoc *doc, ShellDoc *vars, const char *text, size_t len, int first_line) {
+    TRACE_SCOPE("shell_parse");
+    ShellParser ps = { text, text + len, first_line, doc, vars };
+
+    while (ps.p < ps.end) {
+        shell_skip_blank(&ps, 1);
+        if (ps.p >= ps.end) {
+            break;
+        }
+        if (*ps.p == ';') {
+            ps.p++;
+            continue;
+        }
+
+        const char *name = ps.p;
+        int is_keyword = 0;
+        if (strncmp(ps.p, "function", 8) == 0 && (ps.p[8] == ' ' || ps.p[8] == '\t')) {
+            ps.p += 8;
+            shell_skip_blank(&ps, 0);
+            name = ps.p;
+            is_keyword = 1;
+        }
+        while (ps.p < ps.end && (is_name_char(*ps.p) || *ps.p == '-' || *ps.p == '.' || *ps.p == '+')) {
+            if (*ps.p == '+' && ps.p + 1 < ps.end && ps.p[1] == '=') {
+                break;
+            }
+            ps.p++;
+        }
+        size_t name_len = ps.p - name;
+
+        int strict_name = name_len > 0 && !isdigit((unsigned char)name[0]);
+        for (size_t i = 0; i < name_len; i++) {
+            strict_name = strict_name && is_name_char(name[i]);
+        }
+        if (!is_keyword && strict_name && ps.p < ps.end && (*ps.p == '=' || (*ps.p == '+' && ps.p[1] == '='))) {
+            int append = *ps.p == '+';
+            ps.p += append ? 2 : 1;
+            shell_parse_assignment(&ps, name, name_len, append);
+            continue;
+        }
+
+        const char *after_name = ps.p;
+        shell_skip_blank(&ps, 0);
+        int has_parens = ps.p + 1 < ps.end && ps.p[0] == '(';
+        if (has_parens) {
+            ps.p++;
+            shell_skip_blank(&ps, 0);
+            has_parens = ps.p < ps.end && *ps.p == ')';
+            if (has_parens) {
+                ps.p++;
+            }
+        }
+        if (name_len > 0 && (has_parens || is_keyword)) {
+            shell_skip_blank(&ps, 1);
+            int line = ps.line;
+            if (ps.p < ps.end && *ps.p == '{') {
+                const char *close = shell_body_end(&ps);
+                if (close) {
+                    ShellItem *item = shell_add(doc, name, name_len, line);
+                    item->body = strndup(ps.p + 1, close - ps.p - 1);
+                    ps.p = close + 1;
+                    continue;
+                }
+                shell_issue(doc, line, "unterminated function '%.*s'", (int)name_len, name);
+                return -1;
+            }
+            shell_issue(doc, line, "function '%.*s' does not use a { } body", (int)name_len, name);
+            shell_skip_statement(&ps);
+            continue;
+        }
+
+        ps.p = after_name;
+        const char *eol = memchr(name, '\n', ps.end - name);
+        int shown = eol ? (int)(eol - name) : (int)(ps.end - name);
+        shell_issue(doc, ps.line, "unsupported statement '%.*s'", shown > 60 ? 60 : shown, name);
+        ps.p = name;
+        shell_skip_statement(&ps);
+    }
+    return 0;
+}
+
+void make_parent_dirs(const char *path) {
+    char dir[4096];
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char *p = dir + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            mkdir(dir, 0755);
+            *p = '/';
+        }
+    }
+}
+
+// PKGBUILD import
+typedef struct {
+    PathList inputs;
+    char **outputs;
+    char **reports;
+    int *statuses;
+    const char *out_dir;
+} ImportJob;
+
+// With -o, each STARBUILD goes to OUT/<dir>/STARBUILD, where <dir> is the
+// PKGBUILD's directory relative to the directory argument it was found
+// under, or the name of its own directory for file arguments.
+char *import_output_path(const char *out_dir, const char *root, const char *input) {
+    const char *slash = strrchr(input, '/');
+    size_t root_len = root ? strlen(root) : 0;
+    StrBuf output = {0};
+    if (root && slash && (size_t)(slash - input) > root_len) {
+        // collect_files joins as root + "/" + name
+        sb_printf(&output, "%s/%.*s/STARBUILD", out_dir, (int)(slash - input - root_len - 1), input + root_len + 1);
     } else {
-        printf("\nAssemble scripts for each package:\n");
+        char dir[4096];
+        snprintf(dir, sizeof(dir), "%.*s", slash ? (int)(slash - input) : 1, slash ? input : ".");
+        char *resolved = realpath(dir[0] ? dir : "/", NULL);
+        const char *name = resolved ? resolved : dir;
+        const char *base = strrchr(name, '/');
+        sb_printf(&output, "%s/%s/STARBUILD", out_dir, base && base[1] ? base + 1 : name);
+        free(resolved);
+    }
+    return output.data;
+}
+
+int compare_import_outputs(const void *a, const void *b, void *context) {
+    ImportJob *job = context;
+    int ia = *(const int *)a;
+    int ib = *(const int *)b;
+    int cmp = strcmp(job->outputs[ia], job->outputs[ib]);
+    return cmp ? cmp : ia - ib;
+}
+
+// Fail every entry whose output path was already claimed by an earlier input
+int import_check_collisions(ImportJob *job) {
+    int *order = malloc(job->inputs.count * sizeof(int));
+    for (int i = 0; i < job->inputs.count; i++) {
+        order[i] = i;
+    }
+    qsort_r(order, job->inputs.count, sizeof(int), compare_import_outputs, job);
+    int collisions = 0;
+    for (int i = 1; i < job->inputs.count; i++) {
+        int first = order[i - 1];
+        int index = order[i];
+        if (strcmp(job->outputs[first], job->outputs[index]) != 0) {
+            continue;
+        }
+        // Keep pointing at the first claimant through runs of duplicates
+        order[i] = first;
+        StrBuf report = {0};
+        sb_printf(&report, "    output %s is already written for %s\n", job->outputs[index], job->inputs.paths[first]);
+        job->reports[index] = report.data;
+        job->statuses[index] = -1;
+        collisions++;
+    }
+    free(order);
+    return collisions;
+}
+
+// PKGBUILD variables with a STARBUILD counterpart stay references
+static const char *import_variable_map[][2] = {
+    {"pkgver", "package_version"},
+    {"pkgname", "package_name"},
+};
+
+// Append a substituted value so the shell reads it back as one literal word
+void import_quote_value(StrBuf *out, const char *value, int in_double) {
+    if (in_double) {
+        for (const char *c = value; *c; c++) {
+            if (*c == '"' || *c == '\\' || *c == '$' || *c == '`') {
+                sb_putc(out, '\\');
+            }
+            sb_putc(out, *c);
+        }
+        return;
+    }
+    int plain = *value != '\0';
+    for (const char *c = value; *c && plain; c++) {
+        plain = isalnum((unsigned char)*c) || strchr("._+-/:=@%,", *c);
+    }
+    if (plain) {
+        sb_append(out, value, strlen(value));
+        return;
+    }
+    sb_putc(out, '\'');
+    for (const char *c = value; *c; c++) {
+        if (*c == '\'') {
+            sb_append(out, "'\\''", 4);
+        } else {
+            sb_putc(out, *c);
+        }
+    }
+    sb_putc(out, '\'');
+}
+
+// Substitute top-level scalars the STARBUILD will no longer define
+void import_script_line(ShellDoc *doc, const char *line, StrBuf *out) {
+    const char *p = line;
+    int in_double = 0;
+    while (*p) {
+        if (*p == '\'' && !in_double) {
+            const char *close = strchr(p + 1, '\'');
+            size_t n = close ? (size_t)(close - p + 1) : strlen(p);
+            sb_append(out, p, n);
+            p += n;
+            continue;
+        }
+        if (*p == '\\' && p[1]) {
+            sb_append(out, p, 2);
+            p += 2;
+            continue;
+        }
+        if (*p == '"') {
+            in_double = !in_double;
+        }
+        if (*p != '$') {
+            sb_putc(out, *p++);
+            continue;
+        }
+
+        const char *name = p + 1;
+        int braced = *name == '{';
+        if (braced) {
+            name++;
+        }
+        size_t len = 0;
+        while (is_name_char(name[len])) {
+            len++;
+        }
+        if (len == 0 || (braced && name[len] != '}')) {
+            sb_putc(out, *p++);
+            continue;
+        }
+        char key[256];
+        snprintf(key, sizeof(key), "%.*s", (int)len, name);
+        const char *mapped = NULL;
+        for (size_t m = 0; m < sizeof(import_variable_map) / sizeof(import_variable_map[0]); m++) {
+            if (strcmp(key, import_variable_map[m][0]) == 0) {
+                mapped = import_variable_map[m][1];
+            }
+        }
+        ShellItem *var = mapped ? NULL : shell_find(doc, key);
+        if (mapped) {
+            sb_printf(out, "${%s}", mapped);
+            p = name + len + braced;
+        } else if (var && !var->is_array && var->value_count == 1) {
+            import_quote_value(out, var->values[0], in_double);
+            p = name + len + braced;
+        } else {
+            sb_putc(out, *p++);
+        }
+    }
+}
+
+const char *import_metadata_keys[] = { "pkgdesc", "license", "depends", "optdepends", "provides", "conflicts" };
+
+int import_metadata_key(const char *line) {
+    for (int k = 0; k < (int)(sizeof(import_metadata_keys) / sizeof(import_metadata_keys[0])); k++) {
+        size_t n = strlen(import_metadata_keys[k]);
+        if (strncmp(line, import_metadata_keys[k], n) == 0 && (line[n] == '=' || (line[n] == '+' && line[n + 1] == '='))) {
+            return k;
+        }
+    }
+    return -1;
+}
+
+void import_list(char array[][256], int *count, ShellItem *item, int strip_description) {
+    if (!item) {
+        return;
+    }
+    for (int i = 0; i < item->value_count; i++) {
+        char value[256];
+        snprintf(value, sizeof(value), "%s", item->values[i]);
+        if (strip_description) {
+            // optdepends entries look like "name: why it is useful"
+            value[strcspn(value, ":")] = '\0';
+        }
+        trim(value);
+        if (value[0]) {
+            add_list_value(array, count, MAX_DEPS, value);
+        }
+    }
+}
+
+// A plain assignment inside a package function replaces the inherited value;
+// += adds to it. Returns 1 when the package replaced the top-level depends.
+int import_package_metadata(Package *pkg, ShellDoc *meta, StarbuildConfig *config, int single) {
+    ShellItem *item;
+    int replaced_depends = 0;
+    if ((item = shell_find(meta, "pkgdesc")) && item->value_count > 0) {
+        snprintf(pkg->description, sizeof(pkg->description), "%s", item->values[0]);
+    }
+    if ((item = shell_find(meta, "license"))) {
+        if (!item->append) {
+            pkg->license_count = 0;
+        }
+        import_list(pkg->license, &pkg->license_count, item, 0);
+    }
+    if ((item = shell_find(meta, "depends"))) {
+        if (single) {
+            // The only package: its depends are the top-level list
+            if (!item->append) {
+                config->global_deps_count = 0;
+            }
+            import_list(config->global_deps, &config->global_deps_count, item, 0);
+        } else {
+            if (!item->append) {
+                pkg->deps_count = 0;
+                replaced_depends = 1;
+            }
+            import_list(pkg->deps, &pkg->deps_count, item, 0);
+        }
+    }
+    if ((item = shell_find(meta, "optdepends"))) {
+        if (!item->append) {
+            pkg->optional_count = 0;
+        }
+        import_list(pkg->optional, &pkg->optional_count, item, 1);
+    }
+    if ((item = shell_find(meta, "provides"))) {
+        if (!item->append) {
+            pkg->provides_count = 0;
+        }
+        import_list(pkg->provides, &pkg->provides_count, item, 0);
+    }
+    if ((item = shell_find(meta, "conflicts"))) {
+        if (!item->append) {
+            pkg->conflicts_count = 0;
+        }
+        import_list(pkg->conflicts, &pkg->conflicts_count, item, 0);
+    }
+    return replaced_depends;
+}
+
+// Turn a function body into script lines; package functions may also set metadata
+void import_function(ShellDoc *doc, ShellItem *function, char script[][MAX_LINE_LENGTH], int *line_count,
+                     ShellDoc *meta, StrBuf *report) {
+    StrBuf assignment = {0};
+    int depth = 0;
+    int assignment_line = 0;
+    int line_number = function->line;
+    char *body = strdup(function->body);
+    char *saveptr = NULL;
+
+    for (char *line = strtok_r(body, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+        line_number++;
+        trim(line);
+        if (line[0] == '\0') {
+            continue;
+        }
+
+        if (meta && (depth > 0 || import_metadata_key(line) >= 0)) {
+            if (assignment.len == 0) {
+                assignment_line = line_number;
+            }
+            sb_append(&assignment, line, strlen(line));
+            sb_putc(&assignment, '\n');
+            for (const char *c = line; *c; c++) {
+                depth += (*c == '(') - (*c == ')');
+            }
+            if (depth <= 0) {
+                shell_parse(meta, doc, assignment.data, assignment.len, assignment_line);
+                assignment.len = 0;
+                depth = 0;
+            }
+            continue;
+        }
+
+        // Script lines are re-indented on output, which breaks heredoc terminators
+        if (strstr(line, "<<") && !strstr(line, "<<<")) {
+            sb_printf(report, "    line %d: heredoc in %s() may not survive re-indentation\n", line_number, function->name);
+        }
+
+        StrBuf expanded = {0};
+        import_script_line(doc, line, &expanded);
+        if (expanded.len >= MAX_LINE_LENGTH) {
+            sb_printf(report, "    line %d: script line longer than %d characters was truncated\n", line_number, MAX_LINE_LENGTH - 1);
+        }
+        if (*line_count >= MAX_SCRIPT_LINES) {
+            sb_printf(report, "    line %d: %s() has more than %d lines, rest dropped\n", line_number, function->name, MAX_SCRIPT_LINES);
+            free(expanded.data);
+            break;
+        }
+        append_script_line(script, line_count, expanded.data);
+        free(expanded.data);
+    }
+
+    if (meta && meta->issues.len > 0) {
+        sb_append(report, meta->issues.data, meta->issues.len);
+        meta->issues.len = 0;
+    }
+    free(assignment.data);
+    free(body);
+}
+
+void import_options(StarbuildConfig *config, ShellItem *item, StrBuf *report) {
+    // PKGBUILD option -> STARBUILD option; NULL means it is already the default
+    static const char *mapping[][2] = {
+        { "!strip", "no-strip" }, { "strip", NULL },
+        { "libtool", "no-remove-la" }, { "!libtool", NULL },
+        { "staticlibs", "no-remove-a" }, { "!staticlibs", NULL },
+        { "docs", "docs" }, { "!docs", "!docs" },
+        { "lto", "lto" }, { "!lto", "!lto" },
+    };
+    if (!item) {
+        return;
+    }
+    for (int i = 0; i < item->value_count; i++) {
+        int known = 0;
+        for (int m = 0; m < (int)(sizeof(mapping) / sizeof(mapping[0])); m++) {
+            if (strcmp(item->values[i], mapping[m][0]) == 0) {
+                known = 1;
+                if (mapping[m][1]) {
+                    add_option_values(config, mapping[m][1]);
+                }
+            }
+        }
+        if (!known) {
+            sb_printf(report, "    line %d: option '%s' has no STARBUILD equivalent\n", item->line, item->values[i]);
+        }
+    }
+}
+
+int import_pkgbuild(const char *path, StarbuildConfig *config, StrBuf *report) {
+    TRACE_SCOPE("import_pkgbuild");
+    size_t size = 0;
+    char *text = read_file(path, &size);
+    if (!text) {
+        sb_printf(report, "    could not read file\n");
+        return -1;
+    }
+
+    ShellDoc doc = {0};
+    shell_parse(&doc, &doc, text, size, 1);
+    free(text);
+    if (doc.issues.len > 0) {
+        sb_append(report, doc.issues.data, doc.issues.len);
+    }
+
+    ShellItem *item = shell_find(&doc, "pkgname");
+    if (!item || item->value_count == 0) {
+        sb_printf(report, "    no pkgname found\n");
+        shell_doc_free(&doc);
+        return -1;
+    }
+    for (int i = 0; i < item->value_count; i++) {
+        if (find_package(config, item->values[i], 1) < 0) {
+            sb_printf(report, "    line %d: more than %d packages, '%s' dropped\n", item->line, MAX_PACKAGES, item->values[i]);
+        }
+    }
+    int single = config->package_count == 1;
+
+    if ((item = shell_find(&doc, "pkgver")) && item->value_count > 0) {
+        snprintf(config->packages[0].version, sizeof(config->packages[0].version), "%s", item->values[0]);
+    }
+    if (shell_find(&doc, "epoch")) {
+        sb_printf(report, "    line %d: epoch is not supported\n", shell_find(&doc, "epoch")->line);
+    }
+
+    // Top-level metadata applies to every package unless a package function overrides it
+    for (int i = 0; i < config->package_count; i++) {
+        Package *pkg = &config->packages[i];
+        if ((item = shell_find(&doc, "pkgdesc")) && item->value_count > 0) {
+            snprintf(pkg->description, sizeof(pkg->description), "%s", item->values[0]);
+        }
+        import_list(pkg->license, &pkg->license_count, shell_find(&doc, "license"), 0);
+        import_list(pkg->optional, &pkg->optional_count, shell_find(&doc, "optdepends"), 1);
+        import_list(pkg->provides, &pkg->provides_count, shell_find(&doc, "provides"), 0);
+        import_list(pkg->conflicts, &pkg->conflicts_count, shell_find(&doc, "conflicts"), 0);
+    }
+    import_list(config->global_deps, &config->global_deps_count, shell_find(&doc, "depends"), 0);
+    import_list(config->build_deps, &config->build_deps_count, shell_find(&doc, "makedepends"), 0);
+    import_list(config->build_deps, &config->build_deps_count, shell_find(&doc, "checkdepends"), 0);
+    if ((item = shell_find(&doc, "source"))) {
+        for (int i = 0; i < item->value_count; i++) {
+            if (config->sources_count < MAX_SOURCES) {
+                snprintf(config->sources[config->sources_count++], sizeof(config->sources[0]), "%s", item->values[i]);
+            } else {
+                sb_printf(report, "    line %d: more than %d sources, '%s' dropped\n", item->line, MAX_SOURCES, item->values[i]);
+            }
+        }
+    }
+    import_options(config, shell_find(&doc, "options"), report);
+
+    // Fields with no STARBUILD counterpart
+    static const char *ignored[] = { "pkgbase", "pkgrel", "arch", "epoch" };
+    for (int i = 0; i < doc.count; i++) {
+        ShellItem *it = &doc.items[i];
+        int handled = it->name[0] == '_' || it->body;
+        const char *mapped[] = { "pkgname", "pkgver", "pkgdesc", "license", "depends", "makedepends", "checkdepends",
+                                 "optdepends", "provides", "conflicts", "source", "options" };
+        for (int m = 0; m < (int)(sizeof(mapped) / sizeof(mapped[0])) && !handled; m++) {
+            handled = strcmp(it->name, mapped[m]) == 0;
+        }
+        for (int m = 0; m < (int)(sizeof(ignored) / sizeof(ignored[0])) && !handled; m++) {
+            handled = strcmp(it->name, ignored[m]) == 0;
+        }
+        if (!handled) {
+            sb_printf(report, "    line %d: field '%s' is not translated\n", it->line, it->name);
+        }
+    }
+
+    // Functions
+    int replaced_depends[MAX_PACKAGES] = {0};
+    for (int i = 0; i < doc.count; i++) {
+        ShellItem *fn = &doc.items[i];
+        if (!fn->body) {
+            continue;
+        }
+        if (strcmp(fn->name, "prepare") == 0) {
+            import_function(&doc, fn, config->prepare_script, &config->prepare_script_lines, NULL, report);
+        } else if (strcmp(fn->name, "build") == 0) {
+            import_function(&doc, fn, config->compile_script, &config->compile_script_lines, NULL, report);
+        } else if (strcmp(fn->name, "check") == 0) {
+            import_function(&doc, fn, config->verify_script, &config->verify_script_lines, NULL, report);
+        } else if (strcmp(fn->name, "package") == 0 || strncmp(fn->name, "package_", 8) == 0) {
+            int pkg = strcmp(fn->name, "package") == 0 ? (single ? 0 : -1) : find_package(config, fn->name + 8, 0);
+            if (pkg < 0) {
+                sb_printf(report, "    line %d: %s() does not match a pkgname entry\n", fn->line, fn->name);
+                continue;
+            }
+            ShellDoc meta = {0};
+            import_function(&doc, fn, config->assemble_scripts[pkg], &config->assemble_script_lines[pkg], &meta, report);
+            replaced_depends[pkg] = import_package_metadata(&config->packages[pkg], &meta, config, single);
+            shell_doc_free(&meta);
+        } else {
+            sb_printf(report, "    line %d: function %s() is not translated\n", fn->line, fn->name);
+        }
+    }
+
+    // STARBUILD package dependencies add to the global list, so once a split
+    // package replaces depends the global list moves down to the others
+    int any_replaced = 0;
+    for (int i = 0; i < config->package_count; i++) {
+        any_replaced |= replaced_depends[i];
+    }
+    if (any_replaced) {
         for (int i = 0; i < config->package_count; i++) {
-            char prompt[256];
-            snprintf(prompt, sizeof(prompt), "Assemble script for %s", config->packages[i].name);
-            get_multiline_input(prompt, config->assemble_scripts[i], &config->assemble_script_lines[i]);
+            Package *pkg = &config->packages[i];
+            if (replaced_depends[i]) {
+                continue;
+            }
+            char merged[MAX_DEPS][256];
+            int merged_count = 0;
+            for (int d = 0; d < config->global_deps_count; d++) {
+                add_list_value(merged, &merged_count, MAX_DEPS, config->global_deps[d]);
+            }
+            for (int d = 0; d < pkg->deps_count; d++) {
+                add_list_value(merged, &merged_count, MAX_DEPS, pkg->deps[d]);
+            }
+            memcpy(pkg->deps, merged, sizeof(merged[0]) * merged_count);
+            pkg->deps_count = merged_count;
+        }
+        config->global_deps_count = 0;
+    }
+
+    for (int i = 0; i < config->package_count; i++) {
+        Package *pkg = &config->packages[i];
+        if (pkg->provides_count || pkg->conflicts_count || pkg->optional_count) {
+            config->enable_advanced_fields = 1;
+        }
+    }
+
+    int issues = doc.issue_count;
+    shell_doc_free(&doc);
+    return report->len > 0 || issues > 0 ? 1 : 0;
+}
+
+void import_work(void *context, int index) {
+    ImportJob *job = context;
+    const char *input = job->inputs.paths[index];
+    StrBuf report = {0};
+    if (job->statuses[index] < 0) {
+        return;
+    }
+
+    StarbuildConfig *config = calloc(1, sizeof(StarbuildConfig));
+    if (!config) {
+        job->statuses[index] = -1;
+        return;
+    }
+    int status = import_pkgbuild(input, config, &report);
+
+    if (status >= 0) {
+        char output[4096];
+        if (job->out_dir) {
+            snprintf(output, sizeof(output), "%s", job->outputs[index]);
+            make_parent_dirs(output);
+        } else {
+            const char *slash = strrchr(input, '/');
+            if (slash) {
+                snprintf(output, sizeof(output), "%.*s/STARBUILD", (int)(slash - input), input);
+            } else {
+                snprintf(output, sizeof(output), "STARBUILD");
+            }
+        }
+        if (write_starbuild(output, config) < 0) {
+            sb_printf(&report, "    could not write %s\n", output);
+            status = -1;
+        }
+    }
+
+    free(config);
+    job->statuses[index] = status;
+    job->reports[index] = report.data;
+}
+
+// Import mode function
+int import_mode(int argc, char *argv[]) {
+    ImportJob job = {0};
+    PathList roots = {0};
+    int threads = default_thread_count();
+
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            job.out_dir = argv[++i];
+        } else {
+            struct stat st;
+            int first = job.inputs.count;
+            int is_dir = stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode);
+            if (is_dir) {
+                collect_files(argv[i], "PKGBUILD", &job.inputs);
+            } else {
+                path_list_add(&job.inputs, argv[i]);
+            }
+            // Roots are recorded per input so -o can keep the relative layout
+            for (int k = first; k < job.inputs.count; k++) {
+                path_list_add(&roots, is_dir ? argv[i] : "");
+            }
+        }
+    }
+    if (job.inputs.count == 0) {
+        print_error("No PKGBUILD files given");
+        path_list_free(&roots);
+        return 1;
+    }
+
+    job.reports = calloc(job.inputs.count, sizeof(char *));
+    job.statuses = calloc(job.inputs.count, sizeof(int));
+    if (job.out_dir) {
+        job.outputs = calloc(job.inputs.count, sizeof(char *));
+        for (int i = 0; i < job.inputs.count; i++) {
+            const char *root = roots.paths[i][0] ? roots.paths[i] : NULL;
+            job.outputs[i] = import_output_path(job.out_dir, root, job.inputs.paths[i]);
+        }
+        import_check_collisions(&job);
+    }
+    path_list_free(&roots);
+    parallel_for(job.inputs.count, threads, import_work, &job);
+
+    int converted = 0;
+    int with_issues = 0;
+    int failed = 0;
+    for (int i = 0; i < job.inputs.count; i++) {
+        if (job.statuses[i] < 0) {
+            failed++;
+            printf("%s: failed\n", job.inputs.paths[i]);
+        } else if (job.statuses[i] > 0) {
+            with_issues++;
+            printf("%s: converted with issues\n", job.inputs.paths[i]);
+        } else {
+            converted++;
+        }
+        if (job.reports[i]) {
+            fputs(job.reports[i], stdout);
+            free(job.reports[i]);
+        }
+    }
+
+    char msg[256];
+    snprintf(msg, sizeof(msg), "Imported %d PKGBUILD(s): %d clean, %d with issues, %d failed",
+             job.inputs.count, converted, with_issues, failed);
+    if (failed) {
+        print_warning(msg);
+    } else {
+        print_success(msg);
+    }
+
+    if (job.outputs) {
+        for (int i = 0; i < job.inputs.count; i++) {
+            free(job.outputs[i]);
+        }
+        free(job.outputs);
+    }
+    free(job.reports);
+    free(job.statuses);
+    path_list_free(&job.inputs);
+    return failed ? 1 : 0;
+}
+
+// Batch generation
+//
+// A batch manifest lists one STARBUILD per line:
+//
+//     # output                 templates             overrides
+//     pkgs/foo/STARBUILD       cmake-lib,policy,foo  package_version=1.2; description=Foo
+//
+// The template chain is resolved as for -t ("-" for none) and the overrides
+// are applied on top with the usual template merge rules.
+#define WATCH_QUIET_MS 100
+#define WATCH_MAX_DELAY_MS 2000
+
+typedef struct {
+    char output[512];
+    char templates[256];
+    char overrides[MAX_LINE];
+    uint64_t hash;
+    int manifest;
+    int line;
+} BatchEntry;
+
+typedef struct {
+    char **manifests;
+    int manifest_count;
+    BatchEntry *entries;
+    int count;
+    int capacity;
+} BatchSet;
+
+// Read a manifest's entries, appending them to the set
+int batch_read_manifest(BatchSet *set, int manifest) {
+    FILE *fp = fopen(set->manifests[manifest], "r");
+    if (!fp) {
+        return -1;
+    }
+
+    char line[MAX_LINE * 2];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        line_number++;
+        line[strcspn(line, "\n")] = 0;
+        trim(line);
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+
+        if (set->count == set->capacity) {
+            set->capacity = set->capacity ? set->capacity * 2 : 64;
+            set->entries = realloc(set->entries, set->capacity * sizeof(BatchEntry));
+        }
+        BatchEntry *entry = &set->entries[set->count];
+        memset(entry, 0, sizeof(*entry));
+        entry->manifest = manifest;
+        entry->line = line_number;
+        entry->hash = hash_string(line);
+
+        char *rest = line;
+        size_t n = strcspn(rest, " \t");
+        snprintf(entry->output, sizeof(entry->output), "%.*s", (int)n, rest);
+        rest += n;
+        while (*rest == ' ' || *rest == '\t') {
+            rest++;
+        }
+        n = strcspn(rest, " \t");
+        snprintf(entry->templates, sizeof(entry->templates), "%.*s", (int)n, rest);
+        rest += n;
+        snprintf(entry->overrides, sizeof(entry->overrides), "%s", rest);
+        trim(entry->overrides);
+
+        if (strcmp(entry->templates, "-") == 0) {
+            entry->templates[0] = '\0';
+        }
+        set->count++;
+    }
+    fclose(fp);
+    return 0;
+}
+
+// Returns -2, writing nothing, when neither templates nor overrides name the package
+int batch_generate_entry(BatchEntry *entry, int *cache_hit) {
+    TRACE_SCOPE("batch_generate_entry");
+    StarbuildConfig *config = calloc(1, sizeof(StarbuildConfig));
+    if (!config) {
+        return -1;
+    }
+
+    *cache_hit = 0;
+    if (entry->templates[0]) {
+        resolve_templates(entry->templates, config, cache_hit);
+    }
+
+    char overrides[MAX_LINE];
+    snprintf(overrides, sizeof(overrides), "%s", entry->overrides);
+    char *saveptr = NULL;
+    for (char *item = strtok_r(overrides, ";", &saveptr); item; item = strtok_r(NULL, ";", &saveptr)) {
+        char *equals = strchr(item, '=');
+        if (!equals) {
+            continue;
+        }
+        *equals = '\0';
+        trim(item);
+        trim(equals + 1);
+        apply_template_value(config, item, equals + 1);
+    }
+    if (config->package_count == 0) {
+        free(config);
+        return -2;
+    }
+
+    make_parent_dirs(entry->output);
+    int result = write_starbuild(entry->output, config);
+    free(config);
+    return result;
+}
+
+// Regenerate the entries flagged in `dirty`; returns how many were written
+int batch_generate(BatchSet *set, const char *dirty) {
+    int written = 0;
+    for (int i = 0; i < set->count; i++) {
+        if (dirty && !dirty[i]) {
+            continue;
+        }
+        int cache_hit = 0;
+        int result = batch_generate_entry(&set->entries[i], &cache_hit);
+        if (result == 0) {
+            written++;
+        } else {
+            char msg[MAX_LINE];
+            snprintf(msg, sizeof(msg), result == -2 ? "%s:%d: no package_name for %s, skipped" : "%s:%d: could not write %s",
+                     set->manifests[set->entries[i].manifest], set->entries[i].line, set->entries[i].output);
+            print_error(msg);
+        }
+    }
+    return written;
+}
+
+int batch_load(BatchSet *set, int argc, char *argv[]) {
+    set->manifests = calloc(argc > 0 ? argc : 1, sizeof(char *));
+    for (int i = 0; i < argc; i++) {
+        set->manifests[set->manifest_count] = argv[i];
+        if (batch_read_manifest(set, set->manifest_count) < 0) {
+            char msg[MAX_LINE];
+            snprintf(msg, sizeof(msg), "Could not read manifest %s", argv[i]);
+            print_error(msg);
+            return -1;
+        }
+        set->manifest_count++;
+    }
+    return 0;
+}
+
+// Batch mode function
+int batch_mode(int argc, char *argv[]) {
+    BatchSet set = {0};
+    if (argc == 0) {
+        print_error("No batch manifest given");
+        return 1;
+    }
+    if (batch_load(&set, argc, argv) < 0) {
+        return 1;
+    }
+
+    int written = batch_generate(&set, NULL);
+    char msg[256];
+    snprintf(msg, sizeof(msg), "Generated %d of %d STARBUILD file(s)", written, set.count);
+    print_success(msg);
+
+    int failed = written != set.count;
+    free(set.entries);
+    free(set.manifests);
+    return failed;
+}
+
+// Non-interactive generation
+//
+// `generate` builds a STARBUILD from flags and config files in a single pass
+// over the arguments, applied in order with the template merge rules:
+// scalars replace, lists are unioned. Script files replace the script.
+static const char *generate_flags[][2] = {
+    {"--name", "package_name"},
+    {"--pkgversion", "package_version"},
+    {"--version", "package_version"},   // alias of --pkgversion
+    {"--description", "description"},
+    {"--license", "license"},
+    {"--depends", "dependencies"},
+    {"--build-depends", "build_dependencies"},
+    {"--source", "sources"},
+    {"--option", "options"},
+    {"--gives", "gives"},
+    {"--clashes", "clashes"},
+    {"--optional", "optional_dependencies"},
+    {"--provides", "provides"},
+    {"--conflicts", "conflicts"},
+};
+
+static const char *generate_script_flags[][2] = {
+    {"--prepare-file", "prepare"},
+    {"--compile-file", "compile"},
+    {"--verify-file", "verify"},
+    {"--assemble-file", "assemble"},
+};
+
+// Replace a script with the lines of a file, mapped rather than read line by line
+int load_script_file(StarbuildConfig *config, const char *key, const char *filename) {
+    int *line_count;
+    char (*script)[MAX_LINE_LENGTH] = template_script(config, key, &line_count);
+    if (!script) {
+        fprintf(stderr, "generate: unknown script '%s'\n", key);
+        return -1;
+    }
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "generate: cannot read %s\n", filename);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    *line_count = 0;
+    const char *data = st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "generate: cannot map %s\n", filename);
+        return -1;
+    }
+
+    const char *end = data + st.st_size;
+    int line_number = 0;
+    for (const char *line = data; line && line < end; ) {
+        const char *eol = memchr(line, '\n', end - line);
+        size_t len = (eol ? eol : end) - line;
+        line_number++;
+        if (len > 0 && line[len - 1] == '\r') {
+            len--;
+        }
+        if (len >= MAX_LINE_LENGTH) {
+            fprintf(stderr, "generate: %s:%d: line longer than %d characters truncated\n", filename, line_number, MAX_LINE_LENGTH - 1);
+            len = MAX_LINE_LENGTH - 1;
+        }
+        if (*line_count >= MAX_SCRIPT_LINES) {
+            fprintf(stderr, "generate: %s: more than %d lines, the rest dropped\n", filename, MAX_SCRIPT_LINES);
+            break;
+        }
+        memcpy(script[*line_count], line, len);
+        script[*line_count][len] = '\0';
+        (*line_count)++;
+        line = eol ? eol + 1 : end;
+    }
+    // A trailing blank line is only the file's final newline
+    while (*line_count > 0 && script[*line_count - 1][0] == '\0') {
+        (*line_count)--;
+    }
+    if (data) {
+        munmap((void *)data, st.st_size);
+    }
+    return 0;
+}
+
+void generate_usage(void) {
+    fprintf(stderr,
+            "Usage: generate [OPTIONS]\n"
+            "  --name NAME[,NAME...]     Package name(s)\n"
+            "  --pkgversion VER          Package version\n"
+            "  --version VER             Alias of --pkgversion: it sets the package version\n"
+            "                            and does not print the program version\n"
+            "  --description TEXT        Package description\n"
+            "  --license, --depends, --build-depends, --source, --option,\n"
+            "  --gives, --clashes, --provides, --conflicts, --optional LIST\n"
+            "                            Comma-separated list values (may repeat)\n"
+            "  --set KEY=VALUE           Any template key, e.g. description_PKG=...\n"
+            "  --config FILE             Apply a template-format config file\n"
+            "  --template CHAIN          Start from a template chain, as with -t\n"
+            "  --prepare-file, --compile-file, --verify-file FILE\n"
+            "  --assemble-file [PKG=]FILE\n"
+            "                            Take a script from a file\n"
+            "  --output FILE             Where to write (default STARBUILD)\n");
+}
+
+int generate_mode(int argc, char *argv[]) {
+    TRACE_SCOPE("generate_mode");
+    StarbuildConfig *config = calloc(1, sizeof(StarbuildConfig));
+    if (!config) {
+        return 1;
+    }
+    const char *output = "STARBUILD";
+    int failed = 0;
+
+    for (int i = 0; i < argc && !failed; i++) {
+        // Both "--flag value" and "--flag=value" are accepted
+        char flag[64];
+        const char *value = NULL;
+        const char *equals = strchr(argv[i], '=');
+        if (strncmp(argv[i], "--", 2) == 0 && equals && (size_t)(equals - argv[i]) < sizeof(flag)) {
+            snprintf(flag, sizeof(flag), "%.*s", (int)(equals - argv[i]), argv[i]);
+            value = equals + 1;
+        } else {
+            snprintf(flag, sizeof(flag), "%s", argv[i]);
+            if (i + 1 < argc) {
+                value = argv[i + 1];
+            }
+            if (strcmp(flag, "-h") != 0 && strcmp(flag, "--help") != 0) {
+                i++;
+            }
         }
+        if (strcmp(flag, "-h") == 0 || strcmp(flag, "--help") == 0) {
+            generate_usage();
+            free(config);
+            return 0;
+        }
+        const char *key = NULL;
+        for (size_t j = 0; j < sizeof(generate_flags) / sizeof(generate_flags[0]); j++) {
+            if (strcmp(flag, generate_flags[j][0]) == 0) {
+                key = generate_flags[j][1];
+            }
+        }
+        const char *script_key = NULL;
+        for (size_t j = 0; j < sizeof(generate_script_flags) / sizeof(generate_script_flags[0]); j++) {
+            if (strcmp(flag, generate_script_flags[j][0]) == 0) {
+                script_key = generate_script_flags[j][1];
+            }
+        }
+
+        int known = key || script_key || strcmp(flag, "--set") == 0 || strcmp(flag, "--config") == 0 ||
+                    strcmp(flag, "--template") == 0 || strcmp(flag, "--output") == 0 || strcmp(flag, "-o") == 0;
+        if (!known) {
+            fprintf(stderr, "generate: unknown option '%s'\n", flag);
+            generate_usage();
+            failed = 1;
+        } else if (!value) {
+            fprintf(stderr, "generate: %s needs a value\n", flag);
+            failed = 1;
+        } else if (key) {
+            apply_template_value(config, key, value);
+        } else if (script_key) {
+            // --assemble-file PKG=FILE targets one package of a split recipe
+            char name[256];
+            const char *filename = value;
+            const char *split = strcmp(script_key, "assemble") == 0 ? strchr(value, '=') : NULL;
+            if (split) {
+                snprintf(name, sizeof(name), "assemble_%.*s", (int)(split - value), value);
+                script_key = name;
+                filename = split + 1;
+            }
+            failed = load_script_file(config, script_key, filename) < 0;
+        } else if (strcmp(flag, "--set") == 0) {
+            char assignment[MAX_LINE];
+            snprintf(assignment, sizeof(assignment), "%s", value);
+            char *split = strchr(assignment, '=');
+            if (!split) {
+                fprintf(stderr, "generate: --set expects KEY=VALUE, got '%s'\n", value);
+                failed = 1;
+                break;
+            }
+            *split = '\0';
+            trim(assignment);
+            trim(split + 1);
+            if (apply_template_value(config, assignment, split + 1) < 0) {
+                fprintf(stderr, "generate: unknown key '%s'\n", assignment);
+                failed = 1;
+            }
+        } else if (strcmp(flag, "--config") == 0) {
+            if (apply_template_file(value, config) < 0) {
+                fprintf(stderr, "generate: cannot read %s\n", value);
+                failed = 1;
+            }
+        } else if (strcmp(flag, "--template") == 0) {
+            int cache_hit;
+            if (resolve_templates(value, config, &cache_hit) == 0) {
+                fprintf(stderr, "generate: no templates found for '%s'\n", value);
+                failed = 1;
+            }
+        } else {
+            output = value;
+        }
+    }
+
+    if (!failed && config->package_count == 0) {
+        fprintf(stderr, "generate: no package name given (--name or package_name in a config)\n");
+        failed = 1;
+    }
+    if (!failed) {
+        make_parent_dirs(output);
     }
+    if (!failed && write_starbuild(output, config) < 0) {
+        fprintf(stderr, "generate: could not write %s\n", output);
+        failed = 1;
+    }
+    free(config);
+    return failed;
 }
 
-void wizard_options(StarbuildConfig *config) {
-    print_header("Package Options");
-    printf("Select package options using arrow keys and Enter to toggle:\n");
-    printf("Use arrow keys to navigate, Enter to toggle, 'q' to finish\n\n");
-    
-    // Enable raw mode for better input handling
-    enable_raw_mode();
-    
-    // Define available options
-    const char *available_options[] = {
-        "no-strip",
-        "no-strip-binaries", 
-        "no-remove-la",
-        "no-remove-a",
-        "man",
-        "libs",
-        "include",
-        "docs",
-        "lto"
-    };
-    int num_options = sizeof(available_options) / sizeof(available_options[0]);
-    
-    // Initialize option states (0 = disabled, 1 = enabled, 2 = negated)
-    int option_states[MAX_OPTIONS] = {0};
-    int selected_option = 0;
-    
-    while (1) {
-        // Clear screen and redraw
-        clear_screen();
-        print_header("Package Options");
-        printf("Select package options using arrow keys and Enter to toggle:\n");
-        printf("Use arrow keys to navigate, Enter to toggle, 'q' to finish\n\n");
-        
-        for (int i = 0; i < num_options; i++) {
-            if (i == selected_option) {
-                printf("  > ");
-            } else {
-                printf("    ");
+// Watch mode
+//
+// Templates and manifests are watched through their directories, so editors
+// that save by renaming a temporary file are still seen. Events are
+// collected until the tree has been quiet for WATCH_QUIET_MS, so a checkout
+// touching hundreds of files causes a single regeneration pass.
+typedef struct {
+    char (*templates)[256];
+    int template_count;
+    int template_capacity;
+    int *manifests;
+    int overflow;   // the kernel queue overflowed and events were lost
+} WatchChanges;
+
+void watch_note_template(WatchChanges *changes, const char *filename) {
+    const char *suffix = strstr(filename, ".template");
+    if (!suffix || suffix[9] != '\0' || suffix == filename) {
+        return;
+    }
+    char name[256];
+    snprintf(name, sizeof(name), "%.*s", (int)(suffix - filename), filename);
+    for (int i = 0; i < changes->template_count; i++) {
+        if (strcmp(changes->templates[i], name) == 0) {
+            return;
+        }
+    }
+    if (changes->template_count == changes->template_capacity) {
+        changes->template_capacity = changes->template_capacity ? changes->template_capacity * 2 : 16;
+        changes->templates = realloc(changes->templates, changes->template_capacity * sizeof(changes->templates[0]));
+    }
+    strcpy(changes->templates[changes->template_count++], name);
+}
+
+const char *path_basename(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+// Drain pending inotify events into the change set
+void watch_read_events(int fd, int template_wd, int *manifest_wds, BatchSet *set, WatchChanges *changes) {
+    char buffer[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while ((len = read(fd, buffer, sizeof(buffer))) > 0) {
+        for (char *p = buffer; p < buffer + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            struct inotify_event *event = (struct inotify_event *)p;
+            if (event->mask & IN_Q_OVERFLOW) {
+                changes->overflow = 1;
             }
-            
-            if (option_states[i] == 0) {
-                // Disabled - not shown
-                printf("  %s\n", available_options[i]);
-            } else if (option_states[i] == 1) {
-                // Enabled - white highlight
-                print_highlighted(available_options[i]);
-                printf("\n");
-            } else if (option_states[i] == 2) {
-                // Negated - red highlight
-                print_disabled("!");
-                print_disabled(available_options[i]);
-                printf("\n");
+            if (event->len == 0) {
+                continue;
+            }
+            if (event->wd == template_wd) {
+                watch_note_template(changes, event->name);
+            }
+            for (int m = 0; m < set->manifest_count; m++) {
+                if (event->wd == manifest_wds[m] && strcmp(event->name, path_basename(set->manifests[m])) == 0) {
+                    changes->manifests[m] = 1;
+                }
             }
         }
-        
-        printf("\nLegend: ");
-        print_highlighted("purple = enabled");
-        printf(", ");
-        print_disabled("red = disabled");
-        printf(", normal = not selected\n");
-        
-        // Get user input
-        int ch = getchar();
-        
-        // Handle arrow keys and other input
-        if (ch == 'q' || ch == 'Q') {
+    }
+}
+
+// Re-read changed manifests and mark entries that are new or were edited
+void watch_reload_manifests(BatchSet *set, WatchChanges *changes, char **dirty) {
+    BatchSet fresh = {0};
+    fresh.manifests = set->manifests;
+    fresh.manifest_count = set->manifest_count;
+    char *fresh_dirty = NULL;
+
+    for (int m = 0; m < set->manifest_count; m++) {
+        int start = fresh.count;
+        if (!changes->manifests[m]) {
+            // Carry unchanged manifests over as they are
+            for (int i = 0; i < set->count; i++) {
+                if (set->entries[i].manifest != m) {
+                    continue;
+                }
+                if (fresh.count == fresh.capacity) {
+                    fresh.capacity = fresh.capacity ? fresh.capacity * 2 : 64;
+                    fresh.entries = realloc(fresh.entries, fresh.capacity * sizeof(BatchEntry));
+                }
+                fresh.entries[fresh.count++] = set->entries[i];
+                fresh_dirty = realloc(fresh_dirty, fresh.count);
+                fresh_dirty[fresh.count - 1] = (*dirty)[i];
+            }
+            continue;
+        }
+
+        if (batch_read_manifest(&fresh, m) < 0) {
+            char msg[MAX_LINE];
+            snprintf(msg, sizeof(msg), "Could not read manifest %s", set->manifests[m]);
+            print_warning(msg);
+        }
+        fresh_dirty = realloc(fresh_dirty, fresh.count ? fresh.count : 1);
+        for (int i = start; i < fresh.count; i++) {
+            // Unchanged lines keep their state; new or edited lines are regenerated
+            BatchEntry *entry = &fresh.entries[i];
+            fresh_dirty[i] = 1;
+            for (int j = 0; j < set->count; j++) {
+                if (set->entries[j].manifest == m && set->entries[j].hash == entry->hash &&
+                    strcmp(set->entries[j].output, entry->output) == 0) {
+                    fresh_dirty[i] = (*dirty)[j];
+                    break;
+                }
+            }
+        }
+    }
+
+    free(set->entries);
+    free(*dirty);
+    set->entries = fresh.entries;
+    set->count = fresh.count;
+    set->capacity = fresh.capacity;
+    *dirty = fresh_dirty ? fresh_dirty : calloc(1, 1);
+}
+
+int watch_mode(int argc, char *argv[]) {
+    BatchSet set = {0};
+    if (argc == 0) {
+        print_error("No batch manifest given");
+        return 1;
+    }
+    if (batch_load(&set, argc, argv) < 0) {
+        return 1;
+    }
+
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        print_error("Could not initialise inotify");
+        return 1;
+    }
+    uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE;
+    mkdir(TEMPLATE_DIR, 0755);
+    int template_wd = inotify_add_watch(fd, TEMPLATE_DIR, mask);
+    char msg[MAX_LINE];
+    if (template_wd < 0) {
+        snprintf(msg, sizeof(msg), "Could not watch %s: %s", TEMPLATE_DIR, strerror(errno));
+        print_error(msg);
+        close(fd);
+        free(set.entries);
+        free(set.manifests);
+        return 1;
+    }
+
+    int *manifest_wds = calloc(set.manifest_count, sizeof(int));
+    for (int m = 0; m < set.manifest_count; m++) {
+        char dir[4096];
+        const char *slash = strrchr(set.manifests[m], '/');
+        if (slash) {
+            snprintf(dir, sizeof(dir), "%.*s", (int)(slash - set.manifests[m]), set.manifests[m]);
+        } else {
+            strcpy(dir, ".");
+        }
+        // Watching the same directory twice returns the same descriptor
+        manifest_wds[m] = inotify_add_watch(fd, dir, mask);
+        if (manifest_wds[m] < 0) {
+            snprintf(msg, sizeof(msg), "Could not watch %.900s: %s", dir, strerror(errno));
+            print_error(msg);
+            close(fd);
+            free(manifest_wds);
+            free(set.entries);
+            free(set.manifests);
+            return 1;
+        }
+    }
+
+    int written = batch_generate(&set, NULL);
+    snprintf(msg, sizeof(msg), "Generated %d STARBUILD file(s); watching for changes (Ctrl+C to stop)", written);
+    print_success(msg);
+
+    WatchChanges changes = {0};
+    changes.manifests = calloc(set.manifest_count, sizeof(int));
+    while (1) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, -1) < 0) {
             break;
-        } else if (ch == 27) { // ESC sequence
-            ch = getchar();
-            if (ch == '[') {
-                ch = getchar();
-                if (ch == 'A') { // Up arrow
-                    selected_option = (selected_option - 1 + num_options) % num_options;
-                } else if (ch == 'B') { // Down arrow
-                    selected_option = (selected_option + 1) % num_options;
+        }
+
+        // Debounce: keep collecting until things settle down
+        double first = monotonic_us();
+        watch_read_events(fd, template_wd, manifest_wds, &set, &changes);
+        while (monotonic_us() - first < WATCH_MAX_DELAY_MS * 1000.0 && poll(&pfd, 1, WATCH_QUIET_MS) > 0) {
+            watch_read_events(fd, template_wd, manifest_wds, &set, &changes);
+        }
+
+        // Lost events could have touched anything, so start over from disk
+        if (changes.overflow) {
+            print_warning("Too many changes at once; regenerating everything");
+            for (int m = 0; m < set.manifest_count; m++) {
+                changes.manifests[m] = 1;
+            }
+        }
+
+        // Each output depends on the layers of its template chain
+        char *dirty = calloc(set.count ? set.count : 1, 1);
+        for (int i = 0; i < set.count && changes.template_count > 0; i++) {
+            char layers[MAX_TEMPLATE_CHAIN][256];
+            int layer_count = split_template_chain(set.entries[i].templates, layers, MAX_TEMPLATE_CHAIN);
+            for (int l = 0; l < layer_count && !dirty[i]; l++) {
+                for (int t = 0; t < changes.template_count; t++) {
+                    if (strcmp(layers[l], changes.templates[t]) == 0) {
+                        dirty[i] = 1;
+                        break;
+                    }
                 }
             }
-        } else if (ch == '\n' || ch == ' ') { // Enter or space
-            // Toggle option state: 0 -> 1 -> 2 -> 0
-            option_states[selected_option] = (option_states[selected_option] + 1) % 3;
         }
+        int manifest_changed = 0;
+        for (int m = 0; m < set.manifest_count; m++) {
+            manifest_changed |= changes.manifests[m];
+        }
+        if (manifest_changed) {
+            watch_reload_manifests(&set, &changes, &dirty);
+        }
+        if (changes.overflow) {
+            memset(dirty, 1, set.count);
+        }
+
+        int affected = 0;
+        for (int i = 0; i < set.count; i++) {
+            affected += dirty[i];
+        }
+        if (affected > 0) {
+            written = batch_generate(&set, dirty);
+            if (changes.overflow) {
+                snprintf(msg, sizeof(msg), "Regenerated %d STARBUILD file(s)", written);
+            } else {
+                snprintf(msg, sizeof(msg), "Regenerated %d STARBUILD file(s) (%d template(s) changed%s)",
+                         written, changes.template_count, manifest_changed ? ", manifest edited" : "");
+            }
+            print_success(msg);
+        }
+        fflush(stdout);
+
+        free(dirty);
+        changes.template_count = 0;
+        changes.overflow = 0;
+        memset(changes.manifests, 0, set.manifest_count * sizeof(int));
     }
-    
-    // Disable raw mode
-    disable_raw_mode();
-    
-    // Convert selected options to config
-    config->options_count = 0;
-    for (int i = 0; i < num_options; i++) {
-        if (option_states[i] == 1) {
-            // Enabled option
-            strcpy(config->options[config->options_count], available_options[i]);
-            config->options_count++;
-        } else if (option_states[i] == 2) {
-            // Negated option
-            snprintf(config->options[config->options_count], sizeof(config->options[config->options_count]), "!%s", available_options[i]);
-            config->options_count++;
+
+    close(fd);
+    free(changes.templates);
+    free(changes.manifests);
+    free(manifest_wds);
+    free(set.entries);
+    free(set.manifests);
+    return 0;
+}
+
+// Affected recipes
+//
+// Given the old and new state of a recipe repository, work out what has to
+// be rebuilt. Each changed STARBUILD is parsed in both versions and diffed
+// field by field; changes that alter the build seed the set, which is then
+// expanded through reverse dependencies. Recipes are printed in waves, each
+// one after the affected recipes it depends on.
+typedef struct {
+    int *items;
+    int count;
+    int capacity;
+} IntList;
+
+void int_list_add(IntList *list, int value) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 4;
+        list->items = realloc(list->items, list->capacity * sizeof(int));
+    }
+    list->items[list->count++] = value;
+}
+
+// Open-addressing map from strings to ints
+typedef struct {
+    char *key;
+    int value;
+} MapSlot;
+
+typedef struct {
+    MapSlot *slots;
+    size_t capacity;
+    size_t count;
+} StringMap;
+
+// Look up `key`, adding it (with value -1) if `create` is set
+int *string_map_find(StringMap *map, const char *key, int create) {
+    if (create && (map->count + 1) * 2 > map->capacity) {
+        StringMap grown = { calloc(map->capacity ? map->capacity * 2 : 1024, sizeof(MapSlot)), map->capacity ? map->capacity * 2 : 1024, map->count };
+        for (size_t i = 0; i < map->capacity; i++) {
+            if (map->slots[i].key) {
+                size_t j = hash_string(map->slots[i].key) & (grown.capacity - 1);
+                while (grown.slots[j].key) {
+                    j = (j + 1) & (grown.capacity - 1);
+                }
+                grown.slots[j] = map->slots[i];
+            }
+        }
+        free(map->slots);
+        *map = grown;
+    }
+    if (map->capacity == 0) {
+        return NULL;
+    }
+    size_t i = hash_string(key) & (map->capacity - 1);
+    while (map->slots[i].key) {
+        if (strcmp(map->slots[i].key, key) == 0) {
+            return &map->slots[i].value;
         }
+        i = (i + 1) & (map->capacity - 1);
     }
+    if (!create) {
+        return NULL;
+    }
+    map->slots[i].key = strdup(key);
+    map->slots[i].value = -1;
+    map->count++;
+    return &map->slots[i].value;
 }
 
-// File generation functions
-void write_array(FILE *fp, const char *name, char array[][256], int count) {
-    if (count == 0) {
-        fprintf(fp, "%s=( )\n", name);
+void string_map_free(StringMap *map) {
+    for (size_t i = 0; i < map->capacity; i++) {
+        free(map->slots[i].key);
+    }
+    free(map->slots);
+    memset(map, 0, sizeof(*map));
+}
+
+typedef struct {
+    char *path;
+    char **provides;
+    int provide_count;
+    char **depends;
+    int depend_count;
+    int parsed;
+    int changed;
+    char *reason;
+    char *note;
+    int wave;
+    int cycle;
+} AffectedRecipe;
+
+typedef struct {
+    IntList providers;
+    IntList dependents;
+} NameLinks;
+
+typedef struct {
+    const char *old_root;
+    const char *new_root;
+    AffectedRecipe *recipes;
+    int count;
+    int compare_all;
+    StringMap paths;
+    StringMap names;
+    NameLinks *links;
+    int link_count;
+    IntList queue;
+    StrBuf removed;
+    PathList others;        // non-recipe files in the new tree, for compare_all
+    char *others_changed;
+} AffectedRun;
+
+int name_has_prefix(const char *name, const char *prefix) {
+    size_t len = strlen(prefix);
+    return strncmp(name, prefix, len) == 0 && (name[len] == '\0' || name[len] == '_');
+}
+
+// Fields that describe a package without changing what gets built
+int field_is_metadata(const char *name) {
+    static const char *fields[] = {"description", "license", "gives", "clashes", "optional_dependencies",
+                                   "optional", "provides", "conflicts"};
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        if (name_has_prefix(name, fields[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Lists whose order carries no meaning
+int field_is_set(const char *name) {
+    return field_is_metadata(name) || name_has_prefix(name, "dependencies") ||
+           strcmp(name, "build_dependencies") == 0 || strcmp(name, "options") == 0 ||
+           strcmp(name, "package_name") == 0;
+}
+
+// Package names, without the version constraint of a dependency
+void add_recipe_name(char ***names, int *count, const char *value) {
+    size_t len = strcspn(value, "<>=:");
+    while (len > 0 && isspace((unsigned char)value[len - 1])) {
+        len--;
+    }
+    if (len == 0) {
         return;
     }
-    
-    fprintf(fp, "%s=( ", name);
-    for (int i = 0; i < count; i++) {
-        fprintf(fp, "\"%s\" ", array[i]);
+    *names = realloc(*names, (*count + 1) * sizeof(char *));
+    (*names)[(*count)++] = strndup(value, len);
+}
+
+void recipe_collect_names(AffectedRecipe *recipe, ShellDoc *doc) {
+    for (int i = 0; i < doc->count; i++) {
+        ShellItem *item = &doc->items[i];
+        if (item->body || shell_find(doc, item->name) != item) {
+            continue;
+        }
+        int provides = strcmp(item->name, "package_name") == 0 || name_has_prefix(item->name, "gives") ||
+                       name_has_prefix(item->name, "provides");
+        int depends = name_has_prefix(item->name, "dependencies") || strcmp(item->name, "build_dependencies") == 0;
+        for (int j = 0; j < item->value_count; j++) {
+            if (provides) {
+                add_recipe_name(&recipe->provides, &recipe->provide_count, item->values[j]);
+            } else if (depends) {
+                add_recipe_name(&recipe->depends, &recipe->depend_count, item->values[j]);
+            }
+        }
     }
-    fprintf(fp, ")\n");
 }
 
-void write_sources_array(FILE *fp, const char *name, char array[][512], int count) {
-    if (count == 0) {
-        fprintf(fp, "%s=( )\n", name);
+void recipe_free(AffectedRecipe *recipe) {
+    for (int i = 0; i < recipe->provide_count; i++) {
+        free(recipe->provides[i]);
+    }
+    for (int i = 0; i < recipe->depend_count; i++) {
+        free(recipe->depends[i]);
+    }
+    free(recipe->provides);
+    free(recipe->depends);
+    free(recipe->path);
+    free(recipe->reason);
+    free(recipe->note);
+}
+
+// Canonical form of a field, so that reordering sets or reformatting scripts is no change
+char *field_canonical(ShellItem *item) {
+    StrBuf out = {0};
+    if (!item) {
+        return strdup("");
+    }
+    if (item->body) {
+        const char *line = item->body;
+        while (*line) {
+            size_t len = strcspn(line, "\n");
+            canonical_script_line(&out, line, len);
+            line += len + (line[len] == '\n');
+        }
+    } else {
+        const char **values = malloc((item->value_count + 1) * sizeof(char *));
+        for (int i = 0; i < item->value_count; i++) {
+            values[i] = item->values[i];
+        }
+        int is_set = field_is_set(item->name);
+        if (is_set) {
+            qsort(values, item->value_count, sizeof(values[0]), compare_strings);
+        }
+        for (int i = 0; i < item->value_count; i++) {
+            if (!is_set || i == 0 || strcmp(values[i], values[i - 1]) != 0) {
+                canonical_value(&out, values[i]);
+            }
+        }
+        free(values);
+    }
+    sb_putc(&out, '\0');
+    return out.data;
+}
+
+void diff_note(StrBuf *list, ShellItem *item) {
+    sb_printf(list, "%s%s%s", list->len ? ", " : "", item->name, item->body ? "()" : "");
+}
+
+// Append the names of changed fields to `rebuild` or `metadata`
+void recipe_diff(ShellDoc *old_doc, ShellDoc *new_doc, StrBuf *rebuild, StrBuf *metadata) {
+    ShellDoc *docs[2] = { new_doc, old_doc };
+    for (int side = 0; side < 2; side++) {
+        ShellDoc *doc = docs[side];
+        ShellDoc *other = docs[!side];
+        for (int i = 0; i < doc->count; i++) {
+            ShellItem *item = &doc->items[i];
+            ShellItem *(*find)(ShellDoc *, const char *) = item->body ? shell_find_function : shell_find;
+            if (find(doc, item->name) != item) {
+                continue;
+            }
+            ShellItem *match = find(other, item->name);
+            if (side == 1 && match) {
+                continue;
+            }
+            char *a = field_canonical(item);
+            char *b = field_canonical(match);
+            if (strcmp(a, b) != 0) {
+                diff_note(field_is_metadata(item->name) ? metadata : rebuild, item);
+            }
+            free(a);
+            free(b);
+        }
+    }
+}
+
+int parse_recipe_file(const char *root, const char *path, ShellDoc *doc) {
+    StrBuf full = {0};
+    sb_printf(&full, "%s/%s", root, path);
+    size_t size;
+    char *text = read_file(full.data, &size);
+    free(full.data);
+    if (!text) {
+        return -1;
+    }
+    memset(doc, 0, sizeof(*doc));
+    shell_parse(doc, doc, text, size, 1);
+    free(text);
+    return 0;
+}
+
+void affected_parse_work(void *context, int index) {
+    AffectedRun *run = context;
+    AffectedRecipe *recipe = &run->recipes[index];
+    char full[4096];
+    snprintf(full, sizeof(full), "%s/%s", run->new_root, recipe->path);
+    size_t size;
+    char *text = read_file(full, &size);
+    if (!text) {
         return;
     }
-    
-    fprintf(fp, "%s=( ", name);
-    for (int i = 0; i < count; i++) {
-        fprintf(fp, "\"%s\" ", array[i]);
+    ShellDoc doc = {0};
+    shell_parse(&doc, &doc, text, size, 1);
+    recipe_collect_names(recipe, &doc);
+    recipe->parsed = 1;
+    shell_doc_free(&doc);
+
+    if (run->compare_all) {
+        snprintf(full, sizeof(full), "%s/%s", run->old_root, recipe->path);
+        size_t old_size;
+        char *old_text = read_file(full, &old_size);
+        recipe->changed = !old_text || old_size != size || memcmp(old_text, text, size) != 0;
+        free(old_text);
+    }
+    free(text);
+}
+
+// Files other than STARBUILDs: a patch or local source that differs counts
+// against the recipe it sits under
+void affected_compare_work(void *context, int index) {
+    AffectedRun *run = context;
+    const char *path = run->others.paths[index];
+    char old_path[4096];
+    char new_path[4096];
+    snprintf(old_path, sizeof(old_path), "%.2000s/%.2000s", run->old_root, path);
+    snprintf(new_path, sizeof(new_path), "%.2000s/%.2000s", run->new_root, path);
+
+    struct stat old_st;
+    struct stat new_st;
+    if (stat(old_path, &old_st) != 0 || stat(new_path, &new_st) != 0 || old_st.st_size != new_st.st_size) {
+        run->others_changed[index] = 1;
+        return;
     }
-    fprintf(fp, ")\n");
+    size_t old_size;
+    size_t new_size;
+    char *old_text = read_file(old_path, &old_size);
+    char *new_text = read_file(new_path, &new_size);
+    run->others_changed[index] = !old_text || !new_text || old_size != new_size ||
+                                 memcmp(old_text, new_text, new_size) != 0;
+    free(old_text);
+    free(new_text);
 }
 
-void write_script(FILE *fp, const char *name, const char *script) {
-    fprintf(fp, "%s() {\n%s}\n\n", name, script);
+NameLinks *name_links(AffectedRun *run, const char *name, int create) {
+    int *slot = string_map_find(&run->names, name, create);
+    if (!slot) {
+        return NULL;
+    }
+    if (*slot < 0) {
+        run->links = realloc(run->links, (run->link_count + 1) * sizeof(NameLinks));
+        memset(&run->links[run->link_count], 0, sizeof(NameLinks));
+        *slot = run->link_count++;
+    }
+    return &run->links[*slot];
 }
 
-void write_multiline_script(FILE *fp, const char *name, char script[][MAX_LINE_LENGTH], int line_count) {
-    fprintf(fp, "%s() {\n", name);
-    for (int i = 0; i < line_count; i++) {
-        if (strlen(script[i]) > 0) {
-            fprintf(fp, "    %s\n", script[i]);
-        }
+void affected_seed(AffectedRun *run, int index, const char *reason) {
+    AffectedRecipe *recipe = &run->recipes[index];
+    if (!recipe->reason) {
+        recipe->reason = strdup(reason);
+        int_list_add(&run->queue, index);
     }
-    fprintf(fp, "}\n\n");
 }
 
-void generate_starbuild_file(StarbuildConfig *config) {
-    FILE *fp = fopen("STARBUILD", "w");
-    if (!fp) {
-        print_error("Could not create STARBUILD file");
-        return;
+void affected_seed_dependents(AffectedRun *run, const char *name, const char *prefix) {
+    NameLinks *links = name_links(run, name, 0);
+    char reason[512];
+    snprintf(reason, sizeof(reason), "%s %s", prefix, name);
+    for (int i = 0; links && i < links->dependents.count; i++) {
+        affected_seed(run, links->dependents.items[i], reason);
     }
-    
-    fprintf(fp, "# STARBUILD generated by StarbuildCreator\n\n");
-    
-    // Package information
-    if (config->package_count == 1) {
-        fprintf(fp, "package_name=\"%s\"\n", config->packages[0].name);
-        fprintf(fp, "package_version=\"%s\"\n", config->packages[0].version);
-        fprintf(fp, "description=\"%s\"\n", config->packages[0].description);
-        
-        // Write license array for single package
-        if (config->packages[0].license_count > 0) {
-            write_array(fp, "license", config->packages[0].license, config->packages[0].license_count);
+}
+
+// Classify one changed path (relative to both roots)
+void affected_classify(AffectedRun *run, const char *path) {
+    char recipe_path[4096];
+    snprintf(recipe_path, sizeof(recipe_path), "%s", path);
+    const char *slash = strrchr(recipe_path, '/');
+    int is_recipe = strcmp(slash ? slash + 1 : recipe_path, "STARBUILD") == 0;
+
+    // Other files belong to the nearest recipe above them (patches, local sources)
+    int *slot = NULL;
+    while (!is_recipe) {
+        char *cut = strrchr(recipe_path, '/');
+        if (!cut) {
+            snprintf(recipe_path, sizeof(recipe_path), "STARBUILD");
+        } else {
+            snprintf(cut + 1, sizeof(recipe_path) - (cut + 1 - recipe_path), "STARBUILD");
         }
-        fprintf(fp, "\n");
-    } else {
-        // Multiple packages
-        fprintf(fp, "package_name=( ");
-        for (int i = 0; i < config->package_count; i++) {
-            fprintf(fp, "\"%s\" ", config->packages[i].name);
+        slot = string_map_find(&run->paths, recipe_path, 0);
+        if (slot || !cut) {
+            break;
         }
-        fprintf(fp, ")\n");
-        fprintf(fp, "package_version=\"%s\"\n", config->packages[0].version);
-        
-        fprintf(fp, "package_descriptions=( ");
-        for (int i = 0; i < config->package_count; i++) {
-            fprintf(fp, "\"%s\" ", config->packages[i].description);
+        *cut = '\0';
+    }
+    if (!is_recipe) {
+        if (slot) {
+            char reason[4096 + 32];
+            snprintf(reason, sizeof(reason), "local file changed: %s", path);
+            affected_seed(run, *slot, reason);
         }
-        fprintf(fp, ")\n\n");
+        return;
     }
-    
-    // Dependencies
-    write_array(fp, "dependencies", config->global_deps, config->global_deps_count);
-    write_array(fp, "build_dependencies", config->build_deps, config->build_deps_count);
-    write_sources_array(fp, "sources", config->sources, config->sources_count);
-    
-    // Write options if any
-    if (config->options_count > 0) {
-        write_array(fp, "options", config->options, config->options_count);
+
+    slot = string_map_find(&run->paths, recipe_path, 0);
+    ShellDoc old_doc;
+    int has_old = parse_recipe_file(run->old_root, recipe_path, &old_doc) == 0;
+    if (!slot) {
+        if (has_old) {
+            // Removed: whatever depended on it has to be looked at again
+            AffectedRecipe removed = {0};
+            recipe_collect_names(&removed, &old_doc);
+            for (int i = 0; i < removed.provide_count; i++) {
+                affected_seed_dependents(run, removed.provides[i], "depends on removed");
+            }
+            sb_printf(&run->removed, "- %s removed\n", recipe_path);
+            recipe_free(&removed);
+            shell_doc_free(&old_doc);
+        }
+        return;
     }
-    
-    fprintf(fp, "\n");
-    
-    // Scripts
-    write_multiline_script(fp, "prepare", config->prepare_script, config->prepare_script_lines);
-    write_multiline_script(fp, "compile", config->compile_script, config->compile_script_lines);
-    write_multiline_script(fp, "verify", config->verify_script, config->verify_script_lines);
-    
-    // Assemble scripts
-    if (config->package_count == 1) {
-        write_multiline_script(fp, "assemble", config->assemble_scripts[0], config->assemble_script_lines[0]);
+    if (!has_old) {
+        affected_seed(run, *slot, "added");
+        return;
+    }
+
+    ShellDoc new_doc;
+    parse_recipe_file(run->new_root, recipe_path, &new_doc);
+    StrBuf rebuild = {0};
+    StrBuf metadata = {0};
+    recipe_diff(&old_doc, &new_doc, &rebuild, &metadata);
+    if (rebuild.len) {
+        sb_putc(&rebuild, '\0');
+        char reason[MAX_LINE];
+        snprintf(reason, sizeof(reason), "changed: %s", rebuild.data);
+        affected_seed(run, *slot, reason);
     } else {
-        for (int i = 0; i < config->package_count; i++) {
-            char script_name[256];
-            snprintf(script_name, sizeof(script_name), "assemble_%s", config->packages[i].name);
-            write_multiline_script(fp, script_name, config->assemble_scripts[i], config->assemble_script_lines[i]);
-        }
+        sb_putc(&metadata, '\0');
+        char note[MAX_LINE];
+        snprintf(note, sizeof(note), "%s%s", metadata.len > 1 ? "metadata: " : "formatting only", metadata.data);
+        free(run->recipes[*slot].note);
+        run->recipes[*slot].note = strdup(note);
     }
-    
-    // Package-specific dependencies
-    if (config->package_count > 1) {
-        for (int i = 0; i < config->package_count; i++) {
-            if (config->packages[i].deps_count > 0) {
-                char deps_name[256];
-                snprintf(deps_name, sizeof(deps_name), "dependencies_%s", config->packages[i].name);
-                write_array(fp, deps_name, config->packages[i].deps, config->packages[i].deps_count);
+    free(rebuild.data);
+    free(metadata.data);
+    shell_doc_free(&old_doc);
+    shell_doc_free(&new_doc);
+}
+
+typedef struct {
+    AffectedRun *run;
+    int *members;
+    int member_count;
+    IntList *successors;
+    int *order;
+    int *low;
+    int *component;
+    int *stack;
+    int stack_count;
+    int *calls;         // depth-first path, kept explicitly so long chains
+    int *next_edge;     // cannot run out of thread stack
+    int next_order;
+    int component_count;
+} WaveGraph;
+
+// Tarjan's algorithm: components come out sinks first
+void wave_strongconnect(WaveGraph *g, int root) {
+    int depth = 0;
+    g->calls[depth++] = root;
+    g->next_edge[root] = 0;
+    g->order[root] = g->low[root] = g->next_order++;
+    g->stack[g->stack_count++] = root;
+    while (depth > 0) {
+        int v = g->calls[depth - 1];
+        if (g->next_edge[v] < g->successors[v].count) {
+            int w = g->successors[v].items[g->next_edge[v]++];
+            if (g->order[w] < 0) {
+                g->calls[depth++] = w;
+                g->next_edge[w] = 0;
+                g->order[w] = g->low[w] = g->next_order++;
+                g->stack[g->stack_count++] = w;
+            } else if (g->component[w] < 0) {
+                g->low[v] = g->order[w] < g->low[v] ? g->order[w] : g->low[v];
             }
+            continue;
+        }
+
+        // All of v's edges are done: close its component, then return to the caller
+        if (g->low[v] == g->order[v]) {
+            int w;
+            do {
+                w = g->stack[--g->stack_count];
+                g->component[w] = g->component_count;
+            } while (w != v);
+            g->component_count++;
+        }
+        depth--;
+        if (depth > 0) {
+            int u = g->calls[depth - 1];
+            g->low[u] = g->low[v] < g->low[u] ? g->low[v] : g->low[u];
         }
     }
-    
-    // Package-specific licenses
-    if (config->package_count > 1) {
-        for (int i = 0; i < config->package_count; i++) {
-            if (config->packages[i].license_count > 0) {
-                char license_name[256];
-                snprintf(license_name, sizeof(license_name), "license_%s", config->packages[i].name);
-                write_array(fp, license_name, config->packages[i].license, config->packages[i].license_count);
+}
+
+// Assign waves over the affected recipes; dependency cycles share a wave
+int affected_waves(AffectedRun *run) {
+    WaveGraph g = {0};
+    g.run = run;
+    g.member_count = run->queue.count;
+    g.members = run->queue.items;
+    int *local = malloc(run->count * sizeof(int));
+    int *marker = malloc(g.member_count * sizeof(int));
+    for (int i = 0; i < run->count; i++) {
+        local[i] = -1;
+    }
+    for (int i = 0; i < g.member_count; i++) {
+        local[g.members[i]] = i;
+        marker[i] = -1;
+    }
+
+    // Edges run from a recipe to the affected recipes that depend on it
+    g.successors = calloc(g.member_count, sizeof(IntList));
+    for (int v = 0; v < g.member_count; v++) {
+        AffectedRecipe *recipe = &run->recipes[g.members[v]];
+        for (int i = 0; i < recipe->provide_count; i++) {
+            NameLinks *links = name_links(run, recipe->provides[i], 0);
+            for (int j = 0; links && j < links->dependents.count; j++) {
+                int w = local[links->dependents.items[j]];
+                if (w >= 0 && w != v && marker[w] != v) {
+                    marker[w] = v;
+                    int_list_add(&g.successors[v], w);
+                }
             }
         }
     }
-    
-    // Advanced fields for single package
-    if (config->package_count == 1 && config->enable_advanced_fields) {
-        if (config->packages[0].gives_count > 0) {
-            write_array(fp, "gives", config->packages[0].gives, config->packages[0].gives_count);
-        }
-        if (config->packages[0].clashes_count > 0) {
-            write_array(fp, "clashes", config->packages[0].clashes, config->packages[0].clashes_count);
-        }
-        if (config->packages[0].optional_dependencies_count > 0) {
-            write_array(fp, "optional_dependencies", config->packages[0].optional_dependencies, config->packages[0].optional_dependencies_count);
+
+    g.order = malloc(g.member_count * sizeof(int));
+    g.low = malloc(g.member_count * sizeof(int));
+    g.component = malloc(g.member_count * sizeof(int));
+    g.stack = malloc(g.member_count * sizeof(int));
+    g.calls = malloc(g.member_count * sizeof(int));
+    g.next_edge = malloc(g.member_count * sizeof(int));
+    for (int v = 0; v < g.member_count; v++) {
+        g.order[v] = -1;
+        g.component[v] = -1;
+    }
+    for (int v = 0; v < g.member_count; v++) {
+        if (g.order[v] < 0) {
+            wave_strongconnect(&g, v);
         }
     }
-    
-    // Advanced fields for multiple packages
-    if (config->package_count > 1 && config->enable_advanced_fields) {
-        for (int i = 0; i < config->package_count; i++) {
-            if (config->packages[i].gives_count > 0) {
-                char gives_name[256];
-                snprintf(gives_name, sizeof(gives_name), "gives_%s", config->packages[i].name);
-                write_array(fp, gives_name, config->packages[i].gives, config->packages[i].gives_count);
-            }
-            if (config->packages[i].clashes_count > 0) {
-                char clashes_name[256];
-                snprintf(clashes_name, sizeof(clashes_name), "clashes_%s", config->packages[i].name);
-                write_array(fp, clashes_name, config->packages[i].clashes, config->packages[i].clashes_count);
-            }
-            if (config->packages[i].optional_dependencies_count > 0) {
-                char optional_deps_name[256];
-                snprintf(optional_deps_name, sizeof(optional_deps_name), "optional_%s", config->packages[i].name);
-                write_array(fp, optional_deps_name, config->packages[i].optional_dependencies, config->packages[i].optional_dependencies_count);
+
+    // Every edge between components goes from a higher number to a lower one
+    int *component_wave = calloc(g.component_count, sizeof(int));
+    int *component_size = calloc(g.component_count, sizeof(int));
+    IntList *by_component = calloc(g.component_count, sizeof(IntList));
+    for (int v = 0; v < g.member_count; v++) {
+        int_list_add(&by_component[g.component[v]], v);
+        component_size[g.component[v]]++;
+    }
+    int waves = 0;
+    for (int c = g.component_count - 1; c >= 0; c--) {
+        for (int i = 0; i < by_component[c].count; i++) {
+            int v = by_component[c].items[i];
+            AffectedRecipe *recipe = &run->recipes[g.members[v]];
+            recipe->wave = component_wave[c];
+            recipe->cycle = component_size[c] > 1;
+            for (int j = 0; j < g.successors[v].count; j++) {
+                int d = g.component[g.successors[v].items[j]];
+                if (d != c && component_wave[d] < component_wave[c] + 1) {
+                    component_wave[d] = component_wave[c] + 1;
+                }
             }
         }
+        if (component_wave[c] + 1 > waves) {
+            waves = component_wave[c] + 1;
+        }
+        free(by_component[c].items);
     }
-    
-    fclose(fp);
-    print_success("STARBUILD file created successfully!");
+
+    for (int v = 0; v < g.member_count; v++) {
+        free(g.successors[v].items);
+    }
+    free(g.successors);
+    free(g.order);
+    free(g.low);
+    free(g.component);
+    free(g.stack);
+    free(g.calls);
+    free(g.next_edge);
+    free(component_wave);
+    free(component_size);
+    free(by_component);
+    free(local);
+    free(marker);
+    return waves;
 }
 
-// Main wizard function
-void run_wizard(StarbuildConfig *config) {
-    clear_screen();
-    printf("Welcome to StarbuildCreator!\n");
-    printf("This wizard will help you create a STARBUILD file.\n\n");
-    
-    // Check for existing STARBUILD file
-    if (access("STARBUILD", F_OK) == 0) {
-        print_warning("STARBUILD file already exists");
-        if (!get_yes_no("Overwrite existing file")) {
-            printf("Operation cancelled.\n");
-            return;
-        }
+int compare_affected(const void *a, const void *b, void *context) {
+    AffectedRun *run = context;
+    const AffectedRecipe *x = &run->recipes[*(const int *)a];
+    const AffectedRecipe *y = &run->recipes[*(const int *)b];
+    if (x->wave != y->wave) {
+        return x->wave - y->wave;
     }
-    
-    // Run wizard steps
-    wizard_advanced_fields(config);
-    wizard_basic_info(config);
-    wizard_dependencies(config);
-    wizard_sources(config);
-    wizard_advanced_package_fields(config);
-    wizard_scripts(config);
-    wizard_options(config);
-    
-    // Preview
-    print_header("Preview");
-    if (config->package_count == 1) {
-        printf("Package: %s %s\n", config->packages[0].name, config->packages[0].version);
-        printf("Description: %s\n", config->packages[0].description);
-        if (config->packages[0].license_count > 0) {
-            printf("License: ");
-            for (int i = 0; i < config->packages[0].license_count; i++) {
-                printf("%s ", config->packages[0].license[i]);
+    return strcmp(x->path, y->path);
+}
+
+void add_changed_path(PathList *changed, const char *path) {
+    while (strncmp(path, "./", 2) == 0) {
+        path += 2;
+    }
+    if (*path) {
+        path_list_add(changed, path);
+    }
+}
+
+int affected_mode(int argc, char *argv[]) {
+    int threads = default_thread_count();
+    int first = 0;
+    if (argc >= 2 && strcmp(argv[0], "-j") == 0) {
+        threads = atoi(argv[1]) > 0 ? atoi(argv[1]) : 1;
+        first = 2;
+    }
+    if (argc - first < 2) {
+        fprintf(stderr, "Usage: affected [-j N] OLD_DIR NEW_DIR [PATH... | -]\n");
+        return 1;
+    }
+
+    AffectedRun run = {0};
+    run.old_root = argv[first];
+    run.new_root = argv[first + 1];
+    PathList changed = {0};
+    for (int i = first + 2; i < argc; i++) {
+        if (strcmp(argv[i], "-") == 0) {
+            char line[4096];
+            while (fgets(line, sizeof(line), stdin)) {
+                line[strcspn(line, "\r\n")] = '\0';
+                add_changed_path(&changed, line);
             }
-            printf("\n");
+        } else {
+            add_changed_path(&changed, argv[i]);
         }
-    } else {
-        printf("Packages:\n");
-        for (int i = 0; i < config->package_count; i++) {
-            printf("  - %s: %s\n", config->packages[i].name, config->packages[i].description);
-            if (config->packages[i].license_count > 0) {
-                printf("    License: ");
-                for (int j = 0; j < config->packages[i].license_count; j++) {
-                    printf("%s ", config->packages[i].license[j]);
-                }
-                printf("\n");
-            }
+    }
+    run.compare_all = changed.count == 0 && argc - first == 2;
+
+    // Parse every recipe in the new tree for the dependency graph. When the
+    // trees are compared in full, the other files are kept for comparison too.
+    PathList files = {0};
+    collect_files(run.new_root, run.compare_all ? NULL : "STARBUILD", &files);
+    run.recipes = calloc(files.count ? files.count : 1, sizeof(AffectedRecipe));
+    size_t root_len = strlen(run.new_root);
+    for (int i = 0; i < files.count; i++) {
+        const char *path = files.paths[i] + root_len + 1;
+        if (strcmp(path_basename(path), "STARBUILD") != 0) {
+            path_list_add(&run.others, path);
+            continue;
         }
+        run.recipes[run.count].path = strdup(path);
+        *string_map_find(&run.paths, path, 1) = run.count++;
     }
-    printf("Dependencies: ");
-    for (int i = 0; i < config->global_deps_count; i++) {
-        printf("%s ", config->global_deps[i]);
+    path_list_free(&files);
+    parallel_for(run.count, threads, affected_parse_work, &run);
+
+    for (int i = 0; i < run.count; i++) {
+        AffectedRecipe *recipe = &run.recipes[i];
+        for (int j = 0; j < recipe->provide_count; j++) {
+            int_list_add(&name_links(&run, recipe->provides[j], 1)->providers, i);
+        }
+        for (int j = 0; j < recipe->depend_count; j++) {
+            int_list_add(&name_links(&run, recipe->depends[j], 1)->dependents, i);
+        }
     }
-    printf("\n");
-    
-    if (config->enable_advanced_fields && config->package_count == 1) {
-        if (config->packages[0].gives_count > 0) {
-            printf("Gives: ");
-            for (int i = 0; i < config->packages[0].gives_count; i++) {
-                printf("%s ", config->packages[0].gives[i]);
+
+    // Without a list of changes, compare the trees recipe by recipe
+    if (run.compare_all) {
+        for (int i = 0; i < run.count; i++) {
+            if (run.recipes[i].changed) {
+                path_list_add(&changed, run.recipes[i].path);
             }
-            printf("\n");
         }
-        if (config->packages[0].clashes_count > 0) {
-            printf("Clashes: ");
-            for (int i = 0; i < config->packages[0].clashes_count; i++) {
-                printf("%s ", config->packages[0].clashes[i]);
+        run.others_changed = calloc(run.others.count ? run.others.count : 1, 1);
+        parallel_for(run.others.count, threads, affected_compare_work, &run);
+        StringMap others = {0};
+        for (int i = 0; i < run.others.count; i++) {
+            *string_map_find(&others, run.others.paths[i], 1) = i;
+            if (run.others_changed[i]) {
+                path_list_add(&changed, run.others.paths[i]);
             }
-            printf("\n");
         }
-        if (config->packages[0].optional_dependencies_count > 0) {
-            printf("Optional dependencies: ");
-            for (int i = 0; i < config->packages[0].optional_dependencies_count; i++) {
-                printf("%s ", config->packages[0].optional_dependencies[i]);
+
+        // Whatever exists only in the old tree was removed
+        PathList old_files = {0};
+        collect_files(run.old_root, NULL, &old_files);
+        size_t old_len = strlen(run.old_root);
+        for (int i = 0; i < old_files.count; i++) {
+            const char *path = old_files.paths[i] + old_len + 1;
+            if (!string_map_find(&run.paths, path, 0) && !string_map_find(&others, path, 0)) {
+                path_list_add(&changed, path);
             }
-            printf("\n");
         }
+        path_list_free(&old_files);
+        string_map_free(&others);
     }
-    
-    if (config->options_count > 0) {
-        printf("Options: ");
-        for (int i = 0; i < config->options_count; i++) {
-            printf("%s ", config->options[i]);
+
+    for (int i = 0; i < changed.count; i++) {
+        affected_classify(&run, changed.paths[i]);
+    }
+
+    // Breadth-first through reverse dependencies; the queue ends up as the set
+    for (int head = 0; head < run.queue.count; head++) {
+        AffectedRecipe *recipe = &run.recipes[run.queue.items[head]];
+        for (int i = 0; i < recipe->provide_count; i++) {
+            affected_seed_dependents(&run, recipe->provides[i], "depends on");
         }
-        printf("\n");
     }
-    
-    if (get_yes_no("Generate STARBUILD file")) {
-        generate_starbuild_file(config);
-        
-        if (get_yes_no("Save as template for future use")) {
-            get_input("Template name", config->template_name, sizeof(config->template_name));
-            save_template(config->template_name, config);
+
+    int waves = affected_waves(&run);
+    qsort_r(run.queue.items, run.queue.count, sizeof(int), compare_affected, &run);
+    printf("# %d recipe(s) to rebuild in %d wave(s)\n", run.queue.count, waves);
+    for (int i = 0; i < run.queue.count; i++) {
+        AffectedRecipe *recipe = &run.recipes[run.queue.items[i]];
+        printf("%d %s %s%s\n", recipe->wave, recipe->path, recipe->reason, recipe->cycle ? " (cycle)" : "");
+    }
+    // Changes that need no rebuild, unless a dependency forces one anyway
+    int header = 0;
+    for (int i = 0; i < run.count; i++) {
+        AffectedRecipe *recipe = &run.recipes[i];
+        if (recipe->note && !recipe->reason) {
+            printf("%s- %s %s\n", header++ ? "" : "# no rebuild needed\n", recipe->path, recipe->note);
         }
-    } else {
-        printf("Operation cancelled.\n");
     }
-}
+    if (run.removed.len) {
+        printf("%s%.*s", header ? "" : "# no rebuild needed\n", (int)run.removed.len, run.removed.data);
+    }
 
-// Quick mode function
-void quick_mode(const char *package_name, const char *version, const char *description) {
-    StarbuildConfig config = {0};
-    
-    strcpy(config.packages[0].name, package_name);
-    strcpy(config.packages[0].version, version);
-    strcpy(config.packages[0].description, description);
-    config.package_count = 1;
-    config.enable_advanced_fields = 0;
-    config.options_count = 0; // No options in quick mode
-    
-    generate_starbuild_file(&config);
-    print_success("Quick STARBUILD file created!");
+    for (int i = 0; i < run.count; i++) {
+        recipe_free(&run.recipes[i]);
+    }
+    for (int i = 0; i < run.link_count; i++) {
+        free(run.links[i].providers.items);
+        free(run.links[i].dependents.items);
+    }
+    free(run.recipes);
+    free(run.links);
+    free(run.queue.items);
+    free(run.removed.data);
+    free(run.others_changed);
+    path_list_free(&run.others);
+    string_map_free(&run.paths);
+    string_map_free(&run.names);
+    path_list_free(&changed);
+    return 0;
 }
 
 // Main function
 int main(int argc, char *argv[]) {
+    // Global options come before the mode, so arguments meant for a mode are never taken
+    int globals = 1;
+    while (globals < argc) {
+        if (strcmp(argv[globals], "--hash-sources") == 0) {
+            build_key_hash_sources = 1;
+            globals++;
+        } else if (strcmp(argv[globals], "--trace") == 0) {
+            if (globals + 1 >= argc) {
+                fprintf(stderr, "--trace needs a file name\n");
+                return 1;
+            }
+            trace_start(argv[globals + 1]);
+            globals += 2;
+        } else if (strcmp(argv[globals], "--") == 0) {
+            globals++;
+            break;
+        } else {
+            break;
+        }
+    }
+    argv[globals - 1] = argv[0];
+    argv += globals - 1;
+    argc -= globals - 1;
+    
     StarbuildConfig config = {0};
     
     // Initialize all counters to 0
@@ -931,14 +6665,57 @@ int main(int argc, char *argv[]) {
             printf("Usage:\n");
             printf("  %s                    Interactive wizard mode\n", argv[0]);
             printf("  %s -q NAME VER DESC   Quick mode with auto-detection\n", argv[0]);
-            printf("  %s -t TEMPLATE        Use template\n", argv[0]);
+            printf("  %s generate [OPTIONS] Write a STARBUILD from flags and config files, no prompts\n", argv[0]);
+            printf("  %s -t TEMPLATE[,TEMPLATE...]\n", argv[0]);
+            printf("                        Use template(s), later ones layered over earlier ones\n");
+            printf("  %s -s ARCHIVE         Prefill the wizard from a local source tarball (combines with -t)\n", argv[0]);
+            printf("  %s run [--profile] [-o TRACE] [FILE]\n", argv[0]);
+            printf("                        Run the build phases, optionally with a timing profile\n");
+            printf("  %s history [PKG] [--last N] [--threshold PCT] [--since DAYS]\n", argv[0]);
+            printf("                        Show build time trends and flag regressions\n");
+            printf("  %s import [-j N] [-o DIR] PATH...\n", argv[0]);
+            printf("                        Convert PKGBUILD files (or trees of them) to STARBUILDs\n");
+            printf("  %s inspect ARCHIVE... Show what a source tarball would prefill\n", argv[0]);
+            printf("  %s licenses [-j N] [PATH...]\n", argv[0]);
+            printf("                        Detect licenses in a source tree or tarball\n");
+            printf("  %s batch MANIFEST...  Generate every STARBUILD listed in the manifest(s)\n", argv[0]);
+            printf("  %s watch MANIFEST...  Like batch, then regenerate outputs as templates change\n", argv[0]);
+            printf("  %s affected [-j N] OLD_DIR NEW_DIR [PATH... | -]\n", argv[0]);
+            printf("                        List the recipes a change requires rebuilding, in waves\n");
             printf("  %s -h, --help         Show this help\n", argv[0]);
+            printf("\nGlobal options, given before the mode:\n");
+            printf("  --trace FILE          Write a Chrome trace of the generator\n");
+            printf("  --hash-sources        Include local source file contents in each STARBUILD's build_key\n");
             return 0;
         } else if (strcmp(argv[1], "-q") == 0 && argc >= 5) {
             quick_mode(argv[2], argv[3], argv[4]);
             return 0;
-        } else if (strcmp(argv[1], "-t") == 0 && argc >= 3) {
-            load_template(argv[2], &config);
+        } else if (strcmp(argv[1], "generate") == 0) {
+            return generate_mode(argc - 2, argv + 2);
+        } else if (strcmp(argv[1], "run") == 0) {
+            return run_mode(argc - 2, argv + 2);
+        } else if (strcmp(argv[1], "history") == 0) {
+            return history_mode(argc - 2, argv + 2);
+        } else if (strcmp(argv[1], "import") == 0) {
+            return import_mode(argc - 2, argv + 2);
+        } else if (strcmp(argv[1], "inspect") == 0) {
+            return inspect_mode(argc - 2, argv + 2);
+        } else if (strcmp(argv[1], "licenses") == 0) {
+            return licenses_mode(argc - 2, argv + 2);
+        } else if (strcmp(argv[1], "affected") == 0) {
+            return affected_mode(argc - 2, argv + 2);
+        } else if (strcmp(argv[1], "batch") == 0) {
+            return batch_mode(argc - 2, argv + 2);
+        } else if (strcmp(argv[1], "watch") == 0) {
+            return watch_mode(argc - 2, argv + 2);
+        } else if (strcmp(argv[1], "-t") == 0 || strcmp(argv[1], "-s") == 0) {
+            for (int i = 1; i + 1 < argc; i += 2) {
+                if (strcmp(argv[i], "-t") == 0) {
+                    load_template(argv[i + 1], &config);
+                } else if (strcmp(argv[i], "-s") == 0) {
+                    add_source_values(config.sources, &config.sources_count, MAX_SOURCES, argv[i + 1]);
+                }
+            }
         }
     }
     